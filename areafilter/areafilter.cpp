@@ -1,372 +1,1074 @@
 #include "VSHelper4.h"
 #include "VapourSynth4.h"
+#include "kernels.hpp"
+#include "labeling.hpp"
+#include "stats_file.hpp"
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <format>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
-typedef struct {
-    int component_count;
-    std::vector<int> size_percentiles;
-    std::vector<int> component_sizes;
-} ComponentStats;
-
-typedef ComponentStats (*ProcessPlaneFn)(const void*, void*, int, int,
-                                         ptrdiff_t, ptrdiff_t, int, float,
-                                         float);
+enum class LabelMethod { Auto = 0, Pixel = 1, Run = 2, Block = 3, Stream = 4 };
 
-typedef struct {
-    VSNode* node;
-    union {
-        int min_area;
-        float percentage;
-    };
-    VSSampleType sample_type;
-    int bits_per_sample;
-    uint16_t max_value;
-    float fg_value;
-    bool write_props;
-    ProcessPlaneFn process_plane_fn;
-} FilterData;
+// Default stream_pixels: planes from about 8K x 8K up are streamed.
+constexpr int64_t DEFAULT_STREAM_PIXELS = int64_t{1} << 26;
 
-class DisjointSet {
+// Hands out one PlaneScratch per in-flight frame. Arenas are returned to the
+// pool afterwards, so the number of arenas settles at the number of frames
+// processed concurrently.
+class ScratchPool {
   private:
-    std::unique_ptr<int[]> parent;
-    std::unique_ptr<int[]> size;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<PlaneScratch>> free_arenas;
+    size_t arena_count = 0;
+    size_t peak_bytes = 0;
 
   public:
-    DisjointSet(int max_elements)
-        : parent(std::make_unique<int[]>(max_elements)),
-          size(std::make_unique<int[]>(max_elements)) {
-        for (auto i = 0; i < max_elements; i++) {
-            parent[i] = i;
-            size[i] = 1;
+    class Lease {
+      private:
+        ScratchPool& pool;
+        std::unique_ptr<PlaneScratch> arena;
+
+      public:
+        Lease(ScratchPool& pool, std::unique_ptr<PlaneScratch> arena)
+            : pool(pool), arena(std::move(arena)) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { pool.release(std::move(arena)); }
+
+        PlaneScratch& operator*() const { return *arena; }
+    };
+
+    auto acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_arenas.empty()) {
+            arena_count++;
+            return Lease(*this, std::make_unique<PlaneScratch>());
         }
+        auto arena = std::move(free_arenas.back());
+        free_arenas.pop_back();
+        return Lease(*this, std::move(arena));
+    }
+
+    void release(std::unique_ptr<PlaneScratch> arena) {
+        auto bytes = arena->capacityBytes();
+        std::lock_guard<std::mutex> lock(mutex);
+        peak_bytes = std::max(peak_bytes, bytes);
+        free_arenas.push_back(std::move(arena));
     }
 
-    auto find(int x) {
-        while (parent[x] != x) {
-            parent[x] = parent[parent[x]];
-            x = parent[x];
+    // Largest single arena seen so far and how many arenas were created.
+    auto highWater() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::make_pair(peak_bytes, arena_count);
+    }
+};
+
+// Output frames of recently seen source frames, for masks that repeat
+// unchanged over many frames such as held animation, credits or logos.
+// Entries are keyed by a hash of the processed planes. The source frame is
+// kept alongside, so that callers can compare it in full before using an
+// entry and a hash collision only costs a miss.
+class FrameCache {
+  private:
+    typedef struct {
+        uint64_t hash;
+        const VSFrame* src;
+        const VSFrame* dst;
+    } Entry;
+
+    const VSAPI* vsapi;
+    size_t capacity;
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+  public:
+    FrameCache(size_t capacity, const VSAPI* vsapi)
+        : vsapi(vsapi), capacity(capacity) {}
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+    ~FrameCache() {
+        for (auto& entry : entries) {
+            vsapi->freeFrame(entry.src);
+            vsapi->freeFrame(entry.dst);
         }
-        return x;
     }
 
-    auto merge(int x, int y) {
-        auto root_x = find(x);
-        auto root_y = find(y);
-        if (root_x == root_y)
-            return;
+    // New references to the source and output frames cached under `hash`,
+    // or null frames when there is no such entry.
+    std::pair<const VSFrame*, const VSFrame*> lookup(uint64_t hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(hash);
+        if (it == index.end())
+            return {nullptr, nullptr};
+        entries.splice(entries.begin(), entries, it->second);
+        return {vsapi->addFrameRef(it->second->src),
+                vsapi->addFrameRef(it->second->dst)};
+    }
 
-        if (size[root_x] < size[root_y]) {
-            parent[root_x] = root_y;
-            size[root_y] += size[root_x];
+    // Caches new references to `src` and `dst`, evicting the least
+    // recently used entry when full. An existing entry under the same hash
+    // is replaced.
+    void insert(uint64_t hash, const VSFrame* src, const VSFrame* dst) {
+        src = vsapi->addFrameRef(src);
+        dst = vsapi->addFrameRef(dst);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (auto it = index.find(hash); it != index.end()) {
+            std::swap(it->second->src, src);
+            std::swap(it->second->dst, dst);
+            entries.splice(entries.begin(), entries, it->second);
         } else {
-            parent[root_y] = root_x;
-            size[root_x] += size[root_y];
+            entries.push_front({hash, src, dst});
+            index[hash] = entries.begin();
+            src = dst = nullptr;
+            if (entries.size() > capacity) {
+                auto& last = entries.back();
+                src = last.src;
+                dst = last.dst;
+                index.erase(last.hash);
+                entries.pop_back();
+            }
         }
+        lock.unlock();
+
+        // Whatever was displaced is freed outside the lock.
+        vsapi->freeFrame(src);
+        vsapi->freeFrame(dst);
     }
-    auto getSize(int x) { return size[find(x)]; }
-};
 
-struct NeighborOffset {
-    int dy, dx;
-};
+    void count(bool hit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        (hit ? hits : misses)++;
+    }
 
-// clang-format off
-constexpr NeighborOffset EIGHT_NEIGHBORS[] = {
-    {-1, -1}, {-1, 0}, {-1, 1}, 
-    { 0, -1},                      { 0, 1},
-    { 1, -1}, { 1, 0}, { 1, 1}
+    auto counters() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::make_pair(hits, misses);
+    }
 };
-// clang-format on
 
-constexpr auto EIGHT_NEIGHBORS_COUNT = 8;
+// Labelings of the last processed frame, for temporal. A frame takes them
+// over only when it directly follows that frame, and its planes are then
+// relabeled where they changed. Any other frame starts from an empty state
+// and is labeled in full, so output does not depend on request order.
+class TemporalCache {
+  public:
+    struct State {
+        int n = -1;
+        // Source frame the planes were labeled from; it keeps their
+        // TemporalPlane::src alive.
+        const VSFrame* src = nullptr;
+        TemporalPlane planes[3];
+    };
 
-// clang-format off
-constexpr NeighborOffset FOUR_NEIGHBORS[] = {
-                        {-1, 0}, 
-    {0, -1},                    {0, 1}, 
-                        {1, 0}
-};
-// clang-format on
+  private:
+    const VSAPI* vsapi;
+    std::mutex mutex;
+    std::unique_ptr<State> latest;
+    // Emptied states, kept for their buffers.
+    std::vector<std::unique_ptr<State>> spare;
+
+    auto clear(State& state) {
+        vsapi->freeFrame(state.src);
+        state.src = nullptr;
+        state.n = -1;
+        for (auto& plane : state.planes)
+            plane.invalidate();
+    }
 
-constexpr auto FOUR_NEIGHBORS_COUNT = 4;
+  public:
+    explicit TemporalCache(const VSAPI* vsapi) : vsapi(vsapi) {}
+    TemporalCache(const TemporalCache&) = delete;
+    TemporalCache& operator=(const TemporalCache&) = delete;
+    ~TemporalCache() {
+        if (latest)
+            vsapi->freeFrame(latest->src);
+    }
 
-template <auto use_8_neighbors> struct NeighborhoodTraits;
+    // The state of frame n - 1 when that is the latest one, or else an
+    // empty state.
+    std::unique_ptr<State> acquire(int n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (latest && latest->n == n - 1)
+            return std::move(latest);
+        if (!spare.empty()) {
+            auto state = std::move(spare.back());
+            spare.pop_back();
+            return state;
+        }
+        return std::make_unique<State>();
+    }
 
-template <> struct NeighborhoodTraits<true> {
-    static constexpr auto neighbors = EIGHT_NEIGHBORS;
-    static constexpr auto count = EIGHT_NEIGHBORS_COUNT;
-};
+    // Hands back `state` after frame n was labeled from `src`. It becomes
+    // the latest unless a later frame is already there.
+    void release(std::unique_ptr<State> state, int n, const VSFrame* src) {
+        vsapi->freeFrame(state->src);
+        state->n = n;
+        state->src = vsapi->addFrameRef(src);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!latest || latest->n < n)
+            std::swap(latest, state);
+        lock.unlock();
+        if (!state)
+            return;
 
-template <> struct NeighborhoodTraits<false> {
-    static constexpr auto neighbors = FOUR_NEIGHBORS;
-    static constexpr auto count = FOUR_NEIGHBORS_COUNT;
+        // Whatever was displaced is emptied outside the lock.
+        clear(*state);
+        lock.lock();
+        spare.push_back(std::move(state));
+    }
 };
 
-template <bool use_8_neighbors, bool use_percentage, typename T>
-static inline auto processPlane(const T* VS_RESTRICT srcp, T* VS_RESTRICT dstp,
-                                auto width, auto height, auto src_stride,
-                                auto dst_stride, auto min_area, auto fg_value,
-                                auto percentage = 0.0f) noexcept {
-    auto src_stride_elements = src_stride / sizeof(T);
-    auto dst_stride_elements = dst_stride / sizeof(T);
-
-    std::unique_ptr<int[]> labels =
-        std::make_unique<int[]>(static_cast<size_t>(width) * height);
-    std::memset(labels.get(), 0,
-                static_cast<size_t>(width) * height * sizeof(int));
-    auto max_labels = (static_cast<size_t>(width) * height) / 2 + 2;
-    DisjointSet ds(max_labels);
-
-    constexpr auto neighbors = NeighborhoodTraits<use_8_neighbors>::neighbors;
-    constexpr auto num_neighbors = NeighborhoodTraits<use_8_neighbors>::count;
-
-    auto next_label = 1;
-
-    for (auto y = 0; y < height; y++) {
-        for (auto x = 0; x < width; x++) {
-            if (srcp[y * src_stride_elements + x] != fg_value)
-                continue;
-
-            auto min_label = 0;
-            std::vector<int> valid_neighbors;
-
-            for (auto i = 0; i < num_neighbors; i++) {
-                auto dy = neighbors[i].dy;
-                auto dx = neighbors[i].dx;
-                auto ny = y + dy;
-                auto nx = x + dx;
-
-                if (ny >= 0 && nx >= 0 && ny < height && nx < width &&
-                    srcp[ny * src_stride_elements + nx] == fg_value) {
-                    auto neighbor_label = labels[ny * width + nx];
-                    if (neighbor_label > 0) {
-                        valid_neighbors.push_back(neighbor_label);
-                        if (min_label == 0 || neighbor_label < min_label)
-                            min_label = neighbor_label;
-                    }
-                }
-            }
+// Frames that may wait in a StatsWriter for an earlier frame before they are
+// written out of order.
+constexpr size_t STATS_QUEUE_FRAMES = 32;
+
+// Writes the blocks of stats_file on a thread of its own, so that frame
+// processing never waits for the disk. Blocks are written in frame order:
+// a frame is held back until the frames before it have arrived, or until
+// STATS_QUEUE_FRAMES frames are waiting, which only happens when frames are
+// requested far out of order or some are never requested. Producers wait
+// while that many are queued. Each frame is written once, however often it
+// is requested.
+class StatsWriter {
+  private:
+    std::FILE* file;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<int, std::vector<uint8_t>> pending;
+    // Whether each frame was ever pushed.
+    std::vector<uint8_t> pushed;
+    int next_frame = 0;
+    bool closing = false;
+    bool failed = false;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait(lock, [&] {
+                return closing ||
+                       (!pending.empty() &&
+                        (pending.begin()->first <= next_frame ||
+                         pending.size() >= STATS_QUEUE_FRAMES));
+            });
+            if (pending.empty())
+                return;
+
+            auto node = pending.extract(pending.begin());
+            next_frame = std::max(next_frame, node.key() + 1);
+            lock.unlock();
+            changed.notify_all();
+
+            auto& block = node.mapped();
+            auto written = std::fwrite(block.data(), 1, block.size(), file);
+            lock.lock();
+            failed |= written != block.size();
+        }
+    }
 
-            if (min_label == 0) {
-                labels[y * width + x] = next_label++;
-            } else {
-                labels[y * width + x] = min_label;
+  public:
+    StatsWriter(std::FILE* file, int num_frames)
+        : file(file), pushed(num_frames) {
+        StatsFileHeader header{{}, STATS_FILE_VERSION, sizeof(StatsRecord)};
+        std::memcpy(header.magic, STATS_FILE_MAGIC, sizeof(header.magic));
+        failed = std::fwrite(&header, sizeof(header), 1, file) != 1;
+        thread = std::thread(&StatsWriter::run, this);
+    }
+    StatsWriter(const StatsWriter&) = delete;
+    StatsWriter& operator=(const StatsWriter&) = delete;
+    ~StatsWriter() { close(); }
+
+    // Queues the blocks of frame n.
+    void push(int n, std::vector<uint8_t> block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (pushed[n])
+            return;
+        pushed[n] = 1;
+        changed.wait(lock,
+                     [&] { return pending.size() < STATS_QUEUE_FRAMES; });
+        pending.emplace(n, std::move(block));
+        lock.unlock();
+        changed.notify_all();
+    }
 
-                for (auto nl : valid_neighbors) {
-                    if (nl != min_label)
-                        ds.merge(min_label, nl);
-                }
+    // Writes whatever is still queued and closes the file. Returns whether
+    // everything was written.
+    bool close() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
             }
+            changed.notify_all();
+            thread.join();
+            failed |= std::fclose(file) != 0;
         }
+        return !failed;
     }
+};
 
-    auto max_label = next_label - 1;
+// Appends the stats_file block of one plane, listing `records`.
+static inline auto appendStatsBlock(std::vector<uint8_t>& block, int n,
+                                    int plane, int width, int height,
+                                    const std::vector<ComponentRecord>& records) {
+    auto append = [&](const auto& value) {
+        auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        block.insert(block.end(), bytes, bytes + sizeof(value));
+    };
 
-    std::vector<int> component_sizes(max_label + 1, 0);
-    for (auto i = 0; i < width * height; i++) {
-        if (labels[i] > 0) {
-            auto root = ds.find(labels[i]);
-            if (root <= max_label)
-                component_sizes[root]++;
-        }
+    append(StatsPlaneHeader{n, plane, width, height,
+                            static_cast<int32_t>(records.size())});
+    block.reserve(block.size() + records.size() * sizeof(StatsRecord));
+    for (auto& record : records) {
+        auto area = static_cast<double>(record.area);
+        append(StatsRecord{record.area, record.bounds.min_x,
+                           record.bounds.min_y, record.bounds.max_x,
+                           record.bounds.max_y,
+                           static_cast<float>(record.sum_x / area),
+                           static_cast<float>(record.sum_y / area),
+                           record.kept ? STATS_RECORD_KEPT : 0});
     }
+}
 
-    ComponentStats stats;
-    std::vector<int> non_zero_sizes;
-    for (auto i = 1; i <= max_label; i++) {
-        if (component_sizes[i] > 0) {
-            non_zero_sizes.push_back(component_sizes[i]);
-        }
+// Names of the PlanePhase values in debug_timing properties and logs.
+constexpr const char* PHASE_NAMES[PLANE_PHASE_COUNT] = {"Scan", "Resolve",
+                                                        "Stats", "Write"};
+
+// Per-frame measurements of debug_timing, summarised when the filter is
+// freed. Every processed frame adds one sample.
+class TimingLog {
+  private:
+    typedef struct {
+        PlaneTimings timings;
+        size_t scratch_bytes;
+    } Sample;
+
+    std::mutex mutex;
+    std::vector<Sample> samples;
+
+    // "min/mean/p99" of `values`, which are sorted in place.
+    static auto summarize(std::vector<double>& values) {
+        std::sort(values.begin(), values.end());
+        auto mean = std::accumulate(values.begin(), values.end(), 0.0) /
+                    values.size();
+        auto p99 = values[(values.size() * 99 + 99) / 100 - 1];
+        return std::format("{:.3f}/{:.3f}/{:.3f}", values.front(), mean, p99);
     }
 
-    stats.component_count = non_zero_sizes.size();
+  public:
+    void add(const PlaneTimings& timings, size_t scratch_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back({timings, scratch_bytes});
+    }
 
-    stats.component_sizes = non_zero_sizes;
+    // One line for the log, or an empty string when no frame was timed.
+    std::string summary() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (samples.empty())
+            return {};
+
+        std::vector<double> values(samples.size());
+        auto metric = [&](auto value) {
+            for (size_t i = 0; i < samples.size(); i++)
+                values[i] = value(samples[i]);
+            return summarize(values);
+        };
+
+        auto text = std::format("{} frame(s), min/mean/p99:", samples.size());
+        for (auto phase = 0; phase < PLANE_PHASE_COUNT; phase++) {
+            text += std::format(" {} {} ms,", PHASE_NAMES[phase],
+                                metric([&](const Sample& sample) {
+                                    return sample.timings.seconds[phase] * 1e3;
+                                }));
+        }
+        text += std::format(
+            " Labels {}, Unions {}, ScratchBytes {}",
+            metric([](const Sample& sample) {
+                return static_cast<double>(sample.timings.labels);
+            }),
+            metric([](const Sample& sample) {
+                return static_cast<double>(sample.timings.unions);
+            }),
+            metric([](const Sample& sample) {
+                return static_cast<double>(sample.scratch_bytes);
+            }));
+        return text;
+    }
+};
 
-    stats.size_percentiles.resize(21);
+typedef struct {
+    std::string component_count;
+    std::vector<std::string> size_percentiles;
+} PropKeys;
+
+// Output frame of filterGetFrame. It is only allocated once the first
+// processed plane turns out to differ from the source; until then, planes
+// whose output would equal the source are shared with it instead of being
+// written. Unchanged planes met after that are copied.
+class FrameTarget {
+  private:
+    const VSFrame* src;
+    const VSFrame* apply;
+    const VSFrame* fallback;
+    float fallback_value;
+    const VSVideoFormat* format;
+    VSCore* core;
+    const VSAPI* vsapi;
+    int num_planes;
+    const VSFrame* plane_src[3];
+    int plane_index[3];
+    VSFrame* dst = nullptr;
+
+    void allocate() {
+        dst = vsapi->newVideoFrame2(format, vsapi->getFrameWidth(src, 0),
+                                    vsapi->getFrameHeight(src, 0), plane_src,
+                                    plane_index, src, core);
+    }
 
-    if (!non_zero_sizes.empty()) {
-        std::sort(non_zero_sizes.begin(), non_zero_sizes.end());
+  public:
+    // Processed planes start out undecided; the others are shared with
+    // `src` when `share_planes` is set and left for the caller otherwise.
+    // With clip_apply, `src` is the frame of clip_apply, and processed
+    // planes are merged from `apply` and from `fallback` or
+    // `fallback_value`; see PlaneDestination.
+    FrameTarget(const VSFrame* src, const VSFrame* apply,
+                const VSFrame* fallback, float fallback_value,
+                const VSVideoFormat* format, const bool* process,
+                bool share_planes, VSCore* core, const VSAPI* vsapi)
+        : src(src), apply(apply), fallback(fallback),
+          fallback_value(fallback_value), format(format), core(core),
+          vsapi(vsapi), num_planes(format->numPlanes) {
+        for (auto plane = 0; plane < num_planes; plane++) {
+            plane_src[plane] =
+                process[plane] || !share_planes ? nullptr : src;
+            plane_index[plane] = plane;
+        }
+    }
+    FrameTarget(const FrameTarget&) = delete;
+    FrameTarget& operator=(const FrameTarget&) = delete;
+    ~FrameTarget() { vsapi->freeFrame(dst); }
+
+    // Where to write `plane`, or no destination when `unchanged` says its
+    // output equals the source plane and nothing needs to be written.
+    template <typename D>
+    PlaneDestination<D> acquire(int plane, bool unchanged) {
+        if (unchanged && !dst) {
+            plane_src[plane] = src;
+            return {nullptr, 0};
+        }
+        if (!dst)
+            allocate();
+        if (unchanged) {
+            vsh::bitblt(vsapi->getWritePtr(dst, plane),
+                        vsapi->getStride(dst, plane),
+                        vsapi->getReadPtr(src, plane),
+                        vsapi->getStride(src, plane),
+                        vsapi->getFrameWidth(src, plane) *
+                            format->bytesPerSample,
+                        vsapi->getFrameHeight(src, plane));
+            return {nullptr, 0};
+        }
 
-        for (auto i = 0; i <= 20; i++) {
-            auto percentile = i * 5.0f;
-            auto idx = static_cast<int>(
-                (percentile / 100.0f) * (non_zero_sizes.size() - 1) + 0.5f);
-            idx = std::min(std::max(0, idx),
-                           static_cast<int>(non_zero_sizes.size() - 1));
-            stats.size_percentiles[i] = non_zero_sizes[idx];
+        PlaneDestination<D> destination{
+            reinterpret_cast<D*>(vsapi->getWritePtr(dst, plane)),
+            vsapi->getStride(dst, plane)};
+        if (apply) {
+            destination.fallback_value = static_cast<D>(fallback_value);
+            destination.apply =
+                reinterpret_cast<const D*>(vsapi->getReadPtr(apply, plane));
+            destination.apply_stride = vsapi->getStride(apply, plane);
         }
-    } else {
-        for (auto i = 0; i <= 20; i++) {
-            stats.size_percentiles[i] = 0;
+        if (fallback) {
+            destination.fallback =
+                reinterpret_cast<const D*>(vsapi->getReadPtr(fallback, plane));
+            destination.fallback_stride = vsapi->getStride(fallback, plane);
         }
+        return destination;
     }
 
-    for (auto y = 0; y < height; y++) {
-        auto row = reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(dstp) +
-                                        y * dst_stride);
-        std::memset(row, 0, width * sizeof(T));
+    // Whether processed planes are merged from clip_apply.
+    bool merges() const { return apply; }
+
+    // Whether any plane had to be allocated.
+    bool allocated() const { return dst; }
+
+    // Hands over the output frame, allocating it now if no plane needed
+    // writing, in which case every plane is shared with the source.
+    VSFrame* release() {
+        if (!dst)
+            allocate();
+        return std::exchange(dst, nullptr);
     }
+};
 
-    auto size_threshold = 0;
+typedef const ComponentStats& (*ProcessPlaneFn)(const void*, int, int,
+                                                ptrdiff_t, FrameTarget&, int,
+                                                const PlaneParams&,
+                                                PlaneScratch&, TemporalPlane*);
 
-    if constexpr (use_percentage) {
-        if (!non_zero_sizes.empty()) {
-            std::sort(non_zero_sizes.begin(), non_zero_sizes.end(),
-                      std::greater<int>());
+typedef struct {
+    VSNode* node;
+    const char* filter_name;
+    VSSampleType sample_type;
+    int bits_per_sample;
+    uint16_t max_value;
+    bool write_props;
+    // Whether any of the shape criteria in params.shape is set.
+    bool use_shape;
+    PlaneParams params;
+    // Format of the output clip. It differs from the input for label and
+    // area maps.
+    VSVideoFormat output_format;
+    ProcessPlaneFn process_plane_fn;
+    bool process[3];
+    int processed_plane_count;
+    std::vector<int> percentiles;
+    // Property keys are built once at creation. plane_prop_keys carry the
+    // _<plane> suffix used when several planes are processed.
+    PropKeys prop_keys;
+    PropKeys plane_prop_keys[3];
+    ScratchPool scratch_pool;
+    // Only set with cache_size > 0.
+    std::unique_ptr<FrameCache> cache;
+    // clip_apply and fallback, or null. Without a fallback clip, pixels
+    // that are not kept are set to fallback_value.
+    VSNode* apply_node;
+    VSNode* fallback_node;
+    float fallback_value;
+    // Only set with debug_timing.
+    std::unique_ptr<TimingLog> timing_log;
+    // Only set with temporal.
+    std::unique_ptr<TemporalCache> temporal;
+    // Only set with stats_file.
+    std::string stats_path;
+    std::unique_ptr<StatsWriter> stats_writer;
+} FilterData;
 
-            auto total_area = 0;
-            for (auto size : non_zero_sizes) {
-                total_area += size;
-            }
+typedef void (*ThresholdPlaneFn)(const void*, void*, int, int, ptrdiff_t,
+                                 ptrdiff_t, uint32_t, float);
 
-            auto area_to_keep =
-                static_cast<int>(total_area * percentage / 100.0f + 0.5f);
-            auto current_area = 0;
+// One output of MultiAreaFilter. `areas` is the shared area map node that
+// does the labeling; `node` is the source, only held when some planes are
+// passed through.
+typedef struct {
+    VSNode* areas;
+    VSNode* node;
+    uint32_t min_area;
+    float fg_value;
+    VSVideoFormat format;
+    bool process[3];
+    ThresholdPlaneFn threshold_plane_fn;
+} ThresholdData;
+
+template <typename A, typename T>
+static inline void
+thresholdPlaneWrapper(const void* areap, void* dstp, int width, int height,
+                      ptrdiff_t area_stride, ptrdiff_t dst_stride,
+                      uint32_t min_area, float fg_value) noexcept {
+    thresholdAreas(static_cast<const A*>(areap), static_cast<T*>(dstp), width,
+                   height, area_stride, dst_stride, static_cast<A>(min_area),
+                   static_cast<T>(fg_value));
+}
 
-            for (auto size : non_zero_sizes) {
-                current_area += size;
-                size_threshold = size;
-                if (current_area >= area_to_keep) {
-                    break;
-                }
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage,
+          bool write_stats, bool fill_holes, bool use_shape, typename T,
+          bool write_values, typename D>
+static inline const ComponentStats&
+processPlaneWrapper(const void* srcp, int width, int height,
+                    ptrdiff_t src_stride, FrameTarget& target, int plane,
+                    const PlaneParams& params, PlaneScratch& scratch,
+                    TemporalPlane* temporal) noexcept {
+    auto src = static_cast<const T*>(srcp);
+    auto min_area = use_percentage ? 0 : params.min_area;
+    auto percentage = use_percentage ? params.percentage : 0.0f;
+    if (params.debug_timing)
+        scratch.timings = PlaneTimings();
+    // Blank and streamed planes list no components.
+    scratch.collect_records = params.collect_records;
+    scratch.records.clear();
+
+    // A mask output equals its source when the source already holds only 0
+    // and fg_value, with 0 background and fg_value foreground, and every
+    // component is kept. A blank plane has no components at all, so it
+    // skips labeling. Planes merged from clip_apply are always written.
+    auto may_share = false;
+    if constexpr (!write_values) {
+        auto key = static_cast<T>(params.fg_key);
+        auto fg_value = static_cast<T>(params.fg_value);
+        may_share = !target.merges() &&
+                    withForegroundTest(params.fg_test, [&](auto t) {
+                        return !isForeground<decltype(t)::value>(T{}, key) &&
+                               isForeground<decltype(t)::value>(fg_value, key);
+                    });
+        if (may_share && isBinaryPlane(src, width, height, src_stride, T{})) {
+            target.acquire<D>(plane, true);
+            if (temporal)
+                temporal->invalidate();
+            if constexpr (write_stats) {
+                scratch.size_distribution.build(std::span<const int>());
+                computeStats(scratch.size_distribution, params.percentiles,
+                             scratch.stats);
             }
+            return scratch.stats;
         }
     }
 
-    for (auto y = 0; y < height; y++) {
-        for (auto x = 0; x < width; x++) {
-            auto label = labels[y * width + x];
-            if (label > 0) {
-                auto component_size = component_sizes[ds.find(label)];
-                auto keep = false;
-
-                if constexpr (use_percentage) {
-                    keep = (component_size >= size_threshold);
-                } else {
-                    keep = (component_size >= min_area);
-                }
+    auto acquire_dst = [&](bool all_kept) {
+        auto unchanged =
+            may_share && all_kept &&
+            isBinaryPlane(src, width, height, src_stride,
+                          static_cast<T>(params.fg_value));
+        return target.acquire<D>(plane, unchanged);
+    };
 
-                if (keep) {
-                    dstp[y * dst_stride_elements + x] = fg_value;
-                }
-            }
+    // The engines are instantiated once more with PlaneTimer, so that they
+    // carry no instrumentation without debug_timing.
+    auto run = [&](auto timer) -> const ComponentStats& {
+        using Timer = typename decltype(timer)::type;
+        if constexpr (method == LabelMethod::Pixel) {
+            static_assert(!fill_holes);
+            auto key = static_cast<T>(params.fg_key);
+            return withForegroundTest(
+                params.fg_test, [&](auto t) -> const ComponentStats& {
+                    auto is_foreground = [key](T value) {
+                        return isForeground<decltype(t)::value>(value, key);
+                    };
+                    return processPlane<use_8_neighbors, use_percentage,
+                                        write_stats, T, use_shape,
+                                        write_values, D, Timer>(
+                        src, acquire_dst, width, height, src_stride,
+                        min_area, params.shape,
+                        static_cast<D>(params.fg_value), params.output,
+                        percentage, params.percentiles, is_foreground,
+                        scratch);
+                });
+        } else {
+            // The foreground test is already baked into params.kernels.
+            auto stream = static_cast<int64_t>(width) * height >=
+                          params.stream_pixels;
+            return processPlaneRuns<use_8_neighbors, use_percentage,
+                                    write_stats, T,
+                                    method == LabelMethod::Block, fill_holes,
+                                    use_shape, write_values, D, Timer>(
+                src, acquire_dst, width, height, src_stride, min_area,
+                params.min_hole_area, params.connect_radius, stream,
+                params.shape, static_cast<D>(params.fg_value), params.output,
+                params.fg_key, percentage, params.percentiles, params.threads,
+                params.kernels, scratch, temporal);
         }
+    };
+
+    if (params.debug_timing)
+        return run(std::type_identity<PlaneTimer>());
+    return run(std::type_identity<NoPlaneTimer>());
+}
+
+static inline auto setFrameProperties(auto props, const auto& stats,
+                                      const PropKeys& keys, auto vsapi) {
+    vsapi->mapSetInt(props, keys.component_count.c_str(),
+                     stats.component_count, maReplace);
+
+    for (size_t i = 0; i < keys.size_percentiles.size(); i++) {
+        vsapi->mapSetInt(props, keys.size_percentiles[i].c_str(),
+                         stats.size_percentiles[i], maReplace);
     }
+}
 
-    return stats;
+// AreaFilter<Phase>Ms, AreaFilterLabels, AreaFilterUnions and
+// AreaFilterScratchBytes of debug_timing.
+static inline auto setTimingProperties(auto props, const PlaneTimings& timings,
+                                       size_t scratch_bytes, auto vsapi) {
+    for (auto phase = 0; phase < PLANE_PHASE_COUNT; phase++) {
+        vsapi->mapSetFloat(
+            props, std::format("AreaFilter{}Ms", PHASE_NAMES[phase]).c_str(),
+            timings.seconds[phase] * 1e3, maReplace);
+    }
+    vsapi->mapSetInt(props, "AreaFilterLabels", timings.labels, maReplace);
+    vsapi->mapSetInt(props, "AreaFilterUnions", timings.unions, maReplace);
+    vsapi->mapSetInt(props, "AreaFilterScratchBytes",
+                     static_cast<int64_t>(scratch_bytes), maReplace);
 }
 
-template <bool use_8_neighbors, bool use_percentage, typename T>
-static inline auto
-processPlaneWrapper(const void* srcp, void* dstp, int width, int height,
-                    ptrdiff_t src_stride, ptrdiff_t dst_stride, int min_area,
-                    float fg_value, float percentage) noexcept {
-    return processPlane<use_8_neighbors, use_percentage, T>(
-        static_cast<const T*>(srcp), static_cast<T*>(dstp), width, height,
-        src_stride, dst_stride, min_area, static_cast<T>(fg_value),
-        use_percentage ? percentage : 0.0f);
+static inline auto makePropKeys(const std::vector<int>& percentiles,
+                                const std::string& suffix) {
+    PropKeys keys;
+    keys.component_count = "ComponentCount" + suffix;
+    for (auto percentile : percentiles) {
+        keys.size_percentiles.push_back(
+            std::format("SizePercentile{}{}", percentile, suffix));
+    }
+    return keys;
 }
 
-static inline auto setFrameProperties(auto dst, auto stats, auto vsapi) {
-    vsapi->mapSetInt(vsapi->getFramePropertiesRW(dst), "ComponentCount",
-                     stats.component_count, maReplace);
+static inline auto copyFrameProperties(auto from, auto to,
+                                       const PropKeys& keys, auto vsapi) {
+    vsapi->mapSetInt(
+        to, keys.component_count.c_str(),
+        vsapi->mapGetInt(from, keys.component_count.c_str(), 0, nullptr),
+        maReplace);
+
+    for (auto& key : keys.size_percentiles) {
+        vsapi->mapSetInt(to, key.c_str(),
+                         vsapi->mapGetInt(from, key.c_str(), 0, nullptr),
+                         maReplace);
+    }
+}
 
-    for (auto i = 0; i <= 20; i++) {
-        auto propName = std::format("SizePercentile{}", i * 5);
-        vsapi->mapSetInt(vsapi->getFramePropertiesRW(dst), propName.c_str(),
-                         stats.size_percentiles[i], maReplace);
+// Hash of the processed planes of `frame`, the key of FrameCache.
+static inline auto hashProcessedPlanes(auto frame, const bool* process,
+                                       auto vsapi) {
+    auto fi = vsapi->getVideoFrameFormat(frame);
+    auto hash = uint64_t{0};
+    for (auto plane = 0; plane < fi->numPlanes; plane++) {
+        if (!process[plane])
+            continue;
+        auto row_size =
+            static_cast<size_t>(vsapi->getFrameWidth(frame, plane)) *
+            fi->bytesPerSample;
+        hash = hashPlane(vsapi->getReadPtr(frame, plane), row_size,
+                         vsapi->getFrameHeight(frame, plane),
+                         vsapi->getStride(frame, plane), hash);
+    }
+    return hash;
+}
+
+static inline auto equalProcessedPlanes(auto a, auto b, const bool* process,
+                                        auto vsapi) {
+    auto fi = vsapi->getVideoFrameFormat(a);
+    for (auto plane = 0; plane < fi->numPlanes; plane++) {
+        if (!process[plane])
+            continue;
+
+        auto width = vsapi->getFrameWidth(a, plane);
+        auto height = vsapi->getFrameHeight(a, plane);
+        if (width != vsapi->getFrameWidth(b, plane) ||
+            height != vsapi->getFrameHeight(b, plane))
+            return false;
+
+        auto ap = vsapi->getReadPtr(a, plane);
+        auto bp = vsapi->getReadPtr(b, plane);
+        auto a_stride = vsapi->getStride(a, plane);
+        auto b_stride = vsapi->getStride(b, plane);
+        for (auto y = 0; y < height; y++) {
+            if (std::memcmp(ap + y * a_stride, bp + y * b_stride,
+                            static_cast<size_t>(width) * fi->bytesPerSample))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The output for `src` built from a cached frame whose processed planes
+// are equal, or null on a miss. Only the processed planes and their
+// properties are taken from the cache, everything else still comes from
+// `src`, so no plane is copied either way.
+static inline const VSFrame* getCachedFrame(auto d, uint64_t hash,
+                                            const VSFrame* src,
+                                            bool share_planes, auto core,
+                                            auto vsapi) {
+    auto [cached_src, cached_dst] = d->cache->lookup(hash);
+    auto hit =
+        cached_src && equalProcessedPlanes(cached_src, src, d->process, vsapi);
+    d->cache->count(hit);
+
+    VSFrame* dst = nullptr;
+    if (hit) {
+        auto fi = vsapi->getVideoFrameFormat(src);
+        const VSFrame* plane_src[3];
+        int plane_index[3];
+        for (auto plane = 0; plane < fi->numPlanes; plane++) {
+            plane_src[plane] =
+                d->process[plane] || !share_planes ? cached_dst : src;
+            plane_index[plane] = plane;
+        }
+
+        dst = vsapi->newVideoFrame2(
+            &d->output_format, vsapi->getFrameWidth(src, 0),
+            vsapi->getFrameHeight(src, 0), plane_src, plane_index, src, core);
+
+        if (d->write_props) {
+            auto from = vsapi->getFramePropertiesRO(cached_dst);
+            auto to = vsapi->getFramePropertiesRW(dst);
+            copyFrameProperties(from, to, d->prop_keys, vsapi);
+            for (auto plane = 0; plane < fi->numPlanes; plane++) {
+                if (d->process[plane] && d->processed_plane_count > 1)
+                    copyFrameProperties(from, to, d->plane_prop_keys[plane],
+                                        vsapi);
+            }
+        }
     }
+
+    vsapi->freeFrame(cached_src);
+    vsapi->freeFrame(cached_dst);
+    return dst;
 }
 
 static inline const VSFrame* VS_CC
-areaFilterGetFrame(auto n, auto activationReason, auto instanceData,
-                   [[maybe_unused]] auto frameData, auto frameCtx, auto core,
-                   auto vsapi) noexcept {
+filterGetFrame(auto n, auto activationReason, auto instanceData,
+               [[maybe_unused]] auto frameData, auto frameCtx, auto core,
+               auto vsapi) noexcept {
     auto d = static_cast<FilterData*>(instanceData);
 
+    // clip_apply and fallback may be shorter than the clip.
+    auto clamp_frame = [&](auto node) {
+        return std::min(n, vsapi->getVideoInfo(node)->numFrames - 1);
+    };
+
     if (activationReason == arInitial) {
         vsapi->requestFrameFilter(n, d->node, frameCtx);
+        if (d->apply_node) {
+            vsapi->requestFrameFilter(clamp_frame(d->apply_node),
+                                      d->apply_node, frameCtx);
+        }
+        if (d->fallback_node) {
+            vsapi->requestFrameFilter(clamp_frame(d->fallback_node),
+                                      d->fallback_node, frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
         auto src = vsapi->getFrameFilter(n, d->node, frameCtx);
         auto fi = vsapi->getVideoFrameFormat(src);
-        auto height = vsapi->getFrameHeight(src, 0);
-        auto width = vsapi->getFrameWidth(src, 0);
 
-        auto dst = vsapi->newVideoFrame(fi, width, height, src, core);
+        // With clip_apply, processed planes are merged from it and the
+        // fallback, and everything else comes from clip_apply.
+        auto apply = d->apply_node
+                         ? vsapi->getFrameFilter(clamp_frame(d->apply_node),
+                                                 d->apply_node, frameCtx)
+                         : nullptr;
+        auto fallback =
+            d->fallback_node
+                ? vsapi->getFrameFilter(clamp_frame(d->fallback_node),
+                                        d->fallback_node, frameCtx)
+                : nullptr;
+
+        // Planes that are not processed are shared with the source frame
+        // instead of being copied. Label and area maps have a format of
+        // their own, so there those planes are zeroed instead.
+        auto share_planes = d->params.output == PlaneOutput::Mask;
+
+        auto hash = uint64_t{0};
+        if (d->cache) {
+            hash = hashProcessedPlanes(src, d->process, vsapi);
+            if (auto dst =
+                    getCachedFrame(d, hash, src, share_planes, core, vsapi)) {
+                vsapi->freeFrame(src);
+                return dst;
+            }
+        }
 
-        std::vector<ComponentStats> plane_stats;
+        FrameTarget target(apply ? apply : src, apply, fallback,
+                           d->fallback_value, &d->output_format, d->process,
+                           share_planes, core, vsapi);
+
+        // The output frame may not exist until the last plane is done, so
+        // the properties are collected separately.
+        auto props =
+            d->write_props || d->timing_log ? vsapi->createMap() : nullptr;
+        auto scratch = d->scratch_pool.acquire();
+        auto temporal = d->temporal ? d->temporal->acquire(n) : nullptr;
+        auto stats_block = std::vector<uint8_t>();
+        auto first_plane = true;
+        // Sums of the processed planes with debug_timing.
+        auto timings = PlaneTimings();
 
         for (auto plane = 0; plane < fi->numPlanes; plane++) {
+            if (!d->process[plane])
+                continue;
+
             const void* srcp = vsapi->getReadPtr(src, plane);
             auto src_stride = vsapi->getStride(src, plane);
-            void* dstp = vsapi->getWritePtr(dst, plane);
-            auto dst_stride = vsapi->getStride(dst, plane);
 
             auto plane_width = vsapi->getFrameWidth(src, plane);
             auto plane_height = vsapi->getFrameHeight(src, plane);
 
-            auto stats = d->process_plane_fn(
-                srcp, dstp, plane_width, plane_height, src_stride, dst_stride,
-                d->min_area, d->fg_value, 0.0f);
+            auto& stats =
+                d->process_plane_fn(srcp, plane_width, plane_height,
+                                    src_stride, target, plane, d->params,
+                                    *scratch,
+                                    temporal ? &temporal->planes[plane]
+                                             : nullptr);
+
+            // The stats live in the scratch arena and are overwritten by the
+            // next plane. The unsuffixed keys always describe the first
+            // processed plane; with several planes each one also gets keys
+            // suffixed with its index.
+            if (d->write_props) {
+                if (first_plane)
+                    setFrameProperties(props, stats, d->prop_keys, vsapi);
+                if (d->processed_plane_count > 1)
+                    setFrameProperties(props, stats, d->plane_prop_keys[plane],
+                                       vsapi);
+            }
+            first_plane = false;
+
+            if (d->stats_writer) {
+                appendStatsBlock(stats_block, n, plane, plane_width,
+                                 plane_height, (*scratch).records);
+            }
+
+            if (d->timing_log) {
+                auto& plane_timings = (*scratch).timings;
+                for (auto phase = 0; phase < PLANE_PHASE_COUNT; phase++)
+                    timings.seconds[phase] += plane_timings.seconds[phase];
+                timings.labels += plane_timings.labels;
+                timings.unions += plane_timings.unions;
+            }
+        }
+
+        if (temporal)
+            d->temporal->release(std::move(temporal), n, src);
+
+        if (d->stats_writer)
+            d->stats_writer->push(n, std::move(stats_block));
 
-            plane_stats.push_back(stats);
+        if (d->timing_log) {
+            auto scratch_bytes = (*scratch).capacityBytes();
+            d->timing_log->add(timings, scratch_bytes);
+            setTimingProperties(props, timings, scratch_bytes, vsapi);
         }
 
-        if (d->write_props && !plane_stats.empty()) {
-            setFrameProperties(dst, plane_stats[0], vsapi);
+        // Nothing differs from the source, so it is returned as is.
+        if (!target.allocated() && share_planes && !props) {
+            if (d->cache)
+                d->cache->insert(hash, src, src);
+            return src;
         }
 
+        auto dst = target.release();
+        if (!share_planes) {
+            for (auto plane = 0; plane < fi->numPlanes; plane++) {
+                if (!d->process[plane]) {
+                    std::memset(vsapi->getWritePtr(dst, plane), 0,
+                                vsapi->getStride(dst, plane) *
+                                    vsapi->getFrameHeight(dst, plane));
+                }
+            }
+        }
+        if (props) {
+            vsapi->copyMap(props, vsapi->getFramePropertiesRW(dst));
+            vsapi->freeMap(props);
+        }
+
+        if (d->cache)
+            d->cache->insert(hash, src, dst);
+
         vsapi->freeFrame(src);
+        vsapi->freeFrame(apply);
+        vsapi->freeFrame(fallback);
 
         return dst;
     }
     return nullptr;
 }
 
-static inline const VSFrame* VS_CC
-relFilterGetFrame(auto n, auto activationReason, auto instanceData,
-                  [[maybe_unused]] auto frameData, auto frameCtx, auto core,
-                  auto vsapi) noexcept {
+static inline auto VS_CC filterFree(auto instanceData, auto core,
+                                    auto vsapi) noexcept {
     auto d = static_cast<FilterData*>(instanceData);
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        auto src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        auto fi = vsapi->getVideoFrameFormat(src);
-        auto height = vsapi->getFrameHeight(src, 0);
-        auto width = vsapi->getFrameWidth(src, 0);
-
-        auto dst = vsapi->newVideoFrame(fi, width, height, src, core);
+    auto [peak_bytes, arena_count] = d->scratch_pool.highWater();
+    vsapi->logMessage(
+        mtDebug,
+        std::format("{}: scratch arena high-water {} bytes, {} arena(s)",
+                    d->filter_name, peak_bytes, arena_count)
+            .c_str(),
+        core);
+
+    if (d->timing_log) {
+        if (auto summary = d->timing_log->summary(); !summary.empty()) {
+            vsapi->logMessage(
+                mtInformation,
+                std::format("{}: debug_timing over {}", d->filter_name,
+                            summary)
+                    .c_str(),
+                core);
+        }
+    }
 
-        std::vector<ComponentStats> plane_stats;
+    if (d->stats_writer && !d->stats_writer->close()) {
+        vsapi->logMessage(mtWarning,
+                          std::format("{}: failed to write stats_file {}",
+                                      d->filter_name, d->stats_path)
+                              .c_str(),
+                          core);
+    }
 
-        for (auto plane = 0; plane < fi->numPlanes; plane++) {
-            const void* srcp = vsapi->getReadPtr(src, plane);
-            auto src_stride = vsapi->getStride(src, plane);
-            void* dstp = vsapi->getWritePtr(dst, plane);
-            auto dst_stride = vsapi->getStride(dst, plane);
+    if (d->cache) {
+        auto [hits, misses] = d->cache->counters();
+        vsapi->logMessage(mtDebug,
+                          std::format("{}: frame cache {} hit(s), {} miss(es)",
+                                      d->filter_name, hits, misses)
+                              .c_str(),
+                          core);
+    }
 
-            auto plane_width = vsapi->getFrameWidth(src, plane);
-            auto plane_height = vsapi->getFrameHeight(src, plane);
+    vsapi->freeNode(d->node);
+    vsapi->freeNode(d->apply_node);
+    vsapi->freeNode(d->fallback_node);
+    delete d;
+}
 
-            auto stats = d->process_plane_fn(
-                srcp, dstp, plane_width, plane_height, src_stride, dst_stride,
-                0, d->fg_value, d->percentage);
+static inline const VSFrame* VS_CC
+thresholdGetFrame(auto n, auto activationReason, auto instanceData,
+                  [[maybe_unused]] auto frameData, auto frameCtx, auto core,
+                  auto vsapi) noexcept {
+    auto d = static_cast<ThresholdData*>(instanceData);
 
-            plane_stats.push_back(stats);
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->areas, frameCtx);
+        if (d->node)
+            vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        auto areas = vsapi->getFrameFilter(n, d->areas, frameCtx);
+        auto src = d->node ? vsapi->getFrameFilter(n, d->node, frameCtx)
+                           : nullptr;
+        auto height = vsapi->getFrameHeight(areas, 0);
+        auto width = vsapi->getFrameWidth(areas, 0);
+
+        // The area map frame carries the source properties and the
+        // statistics, so it is the property source.
+        const VSFrame* plane_src[3];
+        int plane_index[3];
+        for (auto plane = 0; plane < d->format.numPlanes; plane++) {
+            plane_src[plane] = d->process[plane] ? nullptr : src;
+            plane_index[plane] = plane;
         }
 
-        if (d->write_props && !plane_stats.empty()) {
-            setFrameProperties(dst, plane_stats[0], vsapi);
+        auto dst = vsapi->newVideoFrame2(&d->format, width, height, plane_src,
+                                         plane_index, areas, core);
+
+        for (auto plane = 0; plane < d->format.numPlanes; plane++) {
+            if (!d->process[plane])
+                continue;
+
+            d->threshold_plane_fn(
+                vsapi->getReadPtr(areas, plane), vsapi->getWritePtr(dst, plane),
+                vsapi->getFrameWidth(areas, plane),
+                vsapi->getFrameHeight(areas, plane),
+                vsapi->getStride(areas, plane), vsapi->getStride(dst, plane),
+                d->min_area, d->fg_value);
         }
 
+        vsapi->freeFrame(areas);
         vsapi->freeFrame(src);
 
         return dst;
@@ -374,12 +1076,13 @@ relFilterGetFrame(auto n, auto activationReason, auto instanceData,
     return nullptr;
 }
 
-static inline auto VS_CC filterFree(auto instanceData,
-                                    [[maybe_unused]] auto core,
-                                    auto vsapi) noexcept {
-    auto d = static_cast<FilterData*>(instanceData);
+static inline auto VS_CC thresholdFree(auto instanceData,
+                                       [[maybe_unused]] auto core,
+                                       auto vsapi) noexcept {
+    auto d = static_cast<ThresholdData*>(instanceData);
+    vsapi->freeNode(d->areas);
     vsapi->freeNode(d->node);
-    free(d);
+    delete d;
 }
 
 static inline auto validateInput(auto in, auto out, auto vsapi, auto& d,
@@ -427,158 +1130,988 @@ static inline void setupCommonFilterData(auto& d, auto vsapi) {
 
     if (d.sample_type == stInteger) {
         if (d.bits_per_sample == 8) {
-            d.fg_value = 255.0f;
+            d.params.fg_value = 255.0f;
         } else {
-            d.fg_value = static_cast<float>(d.max_value);
+            d.params.fg_value = static_cast<float>(d.max_value);
         }
     } else {
-        d.fg_value = 1.0f;
+        d.params.fg_value = 1.0f;
     }
 }
 
-static inline void selectProcessFunction(auto& d, auto use_8_neighbors,
-                                         auto use_percentage) {
-    if (d.sample_type == stInteger) {
-        if (d.bits_per_sample == 8) {
-            if (use_8_neighbors) {
-                d.process_plane_fn =
-                    use_percentage ? processPlaneWrapper<true, true, uint8_t>
-                                   : processPlaneWrapper<true, false, uint8_t>;
-            } else {
-                d.process_plane_fn =
-                    use_percentage ? processPlaneWrapper<false, true, uint8_t>
-                                   : processPlaneWrapper<false, false, uint8_t>;
-            }
-        } else {
-            if (use_8_neighbors) {
-                d.process_plane_fn =
-                    use_percentage ? processPlaneWrapper<true, true, uint16_t>
-                                   : processPlaneWrapper<true, false, uint16_t>;
-            } else {
-                d.process_plane_fn =
-                    use_percentage
-                        ? processPlaneWrapper<false, true, uint16_t>
-                        : processPlaneWrapper<false, false, uint16_t>;
-            }
+// Label and area maps are written as 16 or 32 bit integers whatever the
+// input type. They never combine with hole filling.
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage,
+          bool write_stats, bool fill_holes, bool use_shape, typename T>
+static inline ProcessPlaneFn selectForOutput(auto& d) {
+    if constexpr (!fill_holes) {
+        if (d.params.output != PlaneOutput::Mask) {
+            if (d.output_format.bitsPerSample == 16)
+                return processPlaneWrapper<method, use_8_neighbors,
+                                           use_percentage, write_stats, false,
+                                           use_shape, T, true, uint16_t>;
+            return processPlaneWrapper<method, use_8_neighbors, use_percentage,
+                                       write_stats, false, use_shape, T, true,
+                                       uint32_t>;
         }
+    }
+    return processPlaneWrapper<method, use_8_neighbors, use_percentage,
+                               write_stats, fill_holes, use_shape, T, false, T>;
+}
+
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage,
+          bool write_stats, bool fill_holes, bool use_shape>
+static inline ProcessPlaneFn selectForSampleType(auto& d) {
+    if (d.sample_type == stInteger) {
+        if (d.bits_per_sample == 8)
+            return selectForOutput<method, use_8_neighbors, use_percentage,
+                                   write_stats, fill_holes, use_shape,
+                                   uint8_t>(d);
+        return selectForOutput<method, use_8_neighbors, use_percentage,
+                               write_stats, fill_holes, use_shape, uint16_t>(
+            d);
+    }
+    return selectForOutput<method, use_8_neighbors, use_percentage,
+                           write_stats, fill_holes, use_shape, float>(d);
+}
+
+// Shape criteria cost nothing unless at least one of them is given.
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage,
+          bool write_stats, bool fill_holes>
+static inline ProcessPlaneFn selectForShape(auto& d) {
+    return d.use_shape
+               ? selectForSampleType<method, use_8_neighbors, use_percentage,
+                                     write_stats, fill_holes, true>(d)
+               : selectForSampleType<method, use_8_neighbors, use_percentage,
+                                     write_stats, fill_holes, false>(d);
+}
+
+// The per-pixel engine does not fill holes; parseCommonOptions rejects that
+// combination.
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage,
+          bool write_stats>
+static inline ProcessPlaneFn selectForHoles(auto& d) {
+    if constexpr (method != LabelMethod::Pixel) {
+        if (d.params.min_hole_area > 0)
+            return selectForShape<method, use_8_neighbors, use_percentage,
+                                  write_stats, true>(d);
+    }
+    return selectForShape<method, use_8_neighbors, use_percentage,
+                          write_stats, false>(d);
+}
+
+// Statistics are only gathered when they end up in frame properties.
+template <LabelMethod method, bool use_8_neighbors, bool use_percentage>
+static inline ProcessPlaneFn selectForStats(auto& d) {
+    return d.write_props
+               ? selectForHoles<method, use_8_neighbors, use_percentage, true>(
+                     d)
+               : selectForHoles<method, use_8_neighbors, use_percentage,
+                                false>(d);
+}
+
+template <LabelMethod method>
+static inline ProcessPlaneFn selectForMethod(auto& d, auto use_8_neighbors,
+                                             auto use_percentage) {
+    // The block engine only exists for 8 neighbors.
+    if constexpr (method == LabelMethod::Block) {
+        return use_percentage ? selectForStats<method, true, true>(d)
+                              : selectForStats<method, true, false>(d);
     } else {
         if (use_8_neighbors) {
-            d.process_plane_fn = use_percentage
-                                     ? processPlaneWrapper<true, true, float>
-                                     : processPlaneWrapper<true, false, float>;
-        } else {
-            d.process_plane_fn = use_percentage
-                                     ? processPlaneWrapper<false, true, float>
-                                     : processPlaneWrapper<false, false, float>;
+            return use_percentage ? selectForStats<method, true, true>(d)
+                                  : selectForStats<method, true, false>(d);
         }
+        return use_percentage ? selectForStats<method, false, true>(d)
+                              : selectForStats<method, false, false>(d);
     }
 }
 
-static inline auto VS_CC areaFilterCreate(const VSMap* in, VSMap* out,
-                                          [[maybe_unused]] void* userData,
-                                          VSCore* core,
-                                          const VSAPI* vsapi) noexcept {
-    FilterData d;
-    FilterData* data;
-    auto err = 0;
-
-    constexpr auto filter_name = "AreaFilter";
+static inline void selectProcessFunction(auto& d, auto use_8_neighbors,
+                                         auto use_percentage, auto method) {
+    // The run-based engine is the default. The per-pixel engine is kept as a
+    // reference implementation.
+    if (method == LabelMethod::Pixel) {
+        d.process_plane_fn = selectForMethod<LabelMethod::Pixel>(
+            d, use_8_neighbors, use_percentage);
+    } else if (method == LabelMethod::Block) {
+        d.process_plane_fn = selectForMethod<LabelMethod::Block>(
+            d, use_8_neighbors, use_percentage);
+    } else {
+        d.process_plane_fn = selectForMethod<LabelMethod::Run>(
+            d, use_8_neighbors, use_percentage);
+    }
+}
 
-    if (!validateInput(in, out, vsapi, d, filter_name)) {
-        return;
+// Label and area maps keep the color family and subsampling of the input.
+static inline void setupOutput(auto& d, PlaneOutput output, int output_bits,
+                               auto core, auto vsapi) {
+    auto vi = vsapi->getVideoInfo(d.node);
+    d.params.output = output;
+    d.output_format = vi->format;
+    if (output != PlaneOutput::Mask) {
+        vsapi->queryVideoFormat(&d.output_format, vi->format.colorFamily,
+                                stInteger, output_bits,
+                                vi->format.subSamplingW,
+                                vi->format.subSamplingH, core);
     }
+}
 
-    setupCommonFilterData(d, vsapi);
+// Reads `output` and `output_bits` and sets up the output format.
+static inline auto parseOutput(auto in, auto out, auto core, auto vsapi,
+                               auto& d, auto filter_name) noexcept {
+    auto err = 0;
 
-    d.min_area = vsapi->mapGetInt(in, "min_area", 0, &err);
-    if (err) {
-        vsapi->mapSetError(
-            out, std::format("{}: min_area must be set", filter_name).c_str());
-        vsapi->freeNode(d.node);
-        return;
-    }
+    auto output = vsapi->mapGetInt(in, "output", 0, &err);
+    if (err)
+        output = static_cast<int>(PlaneOutput::Mask);
 
-    if (d.min_area <= 0) {
+    if (output < static_cast<int>(PlaneOutput::Mask) ||
+        output > static_cast<int>(PlaneOutput::Area)) {
         vsapi->mapSetError(
-            out, std::format("{}: min_area must be greater than 0, got {}",
-                             filter_name, d.min_area)
+            out, std::format("{}: output must be 0 (mask), 1 (label) or 2 "
+                             "(area), got {}",
+                             filter_name, output)
                      .c_str());
         vsapi->freeNode(d.node);
-        return;
+        return false;
     }
 
-    auto use_8_neighbors = !!vsapi->mapGetInt(in, "neighbors8", 0, &err);
-    if (err)
-        use_8_neighbors = false;
-
-    d.write_props = !!vsapi->mapGetInt(in, "write_props", 0, &err);
+    auto output_bits = vsapi->mapGetInt(in, "output_bits", 0, &err);
     if (err)
-        d.write_props = true;
+        output_bits = 16;
 
-    selectProcessFunction(d, use_8_neighbors, false);
+    if (output_bits != 16 && output_bits != 32) {
+        vsapi->mapSetError(
+            out, std::format("{}: output_bits must be 16 or 32, got {}",
+                             filter_name, output_bits)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
 
-    data = static_cast<FilterData*>(malloc(sizeof(d)));
-    *data = d;
+    setupOutput(d, static_cast<PlaneOutput>(output),
+                static_cast<int>(output_bits), core, vsapi);
 
-    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}};
-    vsapi->createVideoFilter(out, filter_name, vsapi->getVideoInfo(d.node),
-                             areaFilterGetFrame, filterFree, fmParallel, deps,
-                             1, data, core);
+    return true;
 }
 
-static inline auto VS_CC relFilterCreate(auto in, auto out,
-                                         [[maybe_unused]] auto userData,
-                                         auto core, auto vsapi) noexcept {
-    FilterData d;
-    FilterData* data;
+// Reads the optional shape criteria into d.params.shape. d.use_shape is set
+// when any of them is given.
+static inline auto parseApply(auto in, auto out, auto vsapi, auto& d,
+                              auto filter_name) noexcept {
     auto err = 0;
-
-    constexpr auto filter_name = "RelFilter";
-
-    if (!validateInput(in, out, vsapi, d, filter_name)) {
-        return;
+    auto has_apply = vsapi->mapNumElements(in, "clip_apply") > 0;
+    auto has_fallback = vsapi->mapNumElements(in, "fallback") > 0;
+    auto has_fallback_value = vsapi->mapNumElements(in, "fallback_value") > 0;
+
+    if (!has_apply) {
+        if (has_fallback || has_fallback_value) {
+            vsapi->mapSetError(
+                out, std::format("{}: fallback and fallback_value require "
+                                 "clip_apply",
+                                 filter_name)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        return true;
     }
 
-    setupCommonFilterData(d, vsapi);
+    if (d.params.output != PlaneOutput::Mask) {
+        vsapi->mapSetError(
+            out, std::format("{}: clip_apply is only supported with output=0 "
+                             "(mask)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
 
-    d.percentage =
+    // The cache only looks at the mask, not at the merged clips.
+    if (d.cache) {
+        vsapi->mapSetError(
+            out, std::format("{}: cache_size is not supported with clip_apply",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (has_fallback && has_fallback_value) {
+        vsapi->mapSetError(
+            out, std::format("{}: fallback and fallback_value are mutually "
+                             "exclusive",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    d.fallback_value =
+        static_cast<float>(vsapi->mapGetFloat(in, "fallback_value", 0, &err));
+    if (err)
+        d.fallback_value = 0.0f;
+
+    if (!std::isfinite(d.fallback_value) ||
+        (d.sample_type == stInteger &&
+         (d.fallback_value < 0 || d.fallback_value > d.max_value))) {
+        vsapi->mapSetError(
+            out, std::format("{}: fallback_value must be a finite value "
+                             "within the sample range, got {}",
+                             filter_name, d.fallback_value)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    // Merged planes are copied sample by sample, so both clips must match
+    // the mask exactly.
+    auto vi = vsapi->getVideoInfo(d.node);
+    d.apply_node = vsapi->mapGetNode(in, "clip_apply", 0, nullptr);
+    if (!vsh::isSameVideoInfo(vsapi->getVideoInfo(d.apply_node), vi)) {
+        vsapi->mapSetError(
+            out, std::format("{}: clip_apply must have the same format and "
+                             "dimensions as clip",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.apply_node);
+        return false;
+    }
+
+    d.fallback_node = vsapi->mapGetNode(in, "fallback", 0, &err);
+    if (d.fallback_node &&
+        !vsh::isSameVideoInfo(vsapi->getVideoInfo(d.fallback_node), vi)) {
+        vsapi->mapSetError(
+            out, std::format("{}: fallback must have the same format and "
+                             "dimensions as clip",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.apply_node);
+        vsapi->freeNode(d.fallback_node);
+        return false;
+    }
+
+    return true;
+}
+
+static inline auto parseShapeCriteria(auto in, auto out, auto vsapi, auto& d,
+                                      auto filter_name) noexcept {
+    auto& shape = d.params.shape;
+    auto err = 0;
+    d.use_shape = false;
+
+    auto max_area = vsapi->mapGetIntSaturated(in, "max_area", 0, &err);
+    if (!err) {
+        if (max_area <= 0) {
+            vsapi->mapSetError(
+                out, std::format("{}: max_area must be greater than 0, got {}",
+                                 filter_name, max_area)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        shape.max_area = max_area;
+        d.use_shape = true;
+    }
+
+    auto min_width = vsapi->mapGetIntSaturated(in, "min_width", 0, &err);
+    if (!err) {
+        if (min_width < 0) {
+            vsapi->mapSetError(
+                out, std::format("{}: min_width must not be negative, got {}",
+                                 filter_name, min_width)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        shape.min_width = min_width;
+        d.use_shape = true;
+    }
+
+    auto min_height = vsapi->mapGetIntSaturated(in, "min_height", 0, &err);
+    if (!err) {
+        if (min_height < 0) {
+            vsapi->mapSetError(
+                out, std::format("{}: min_height must not be negative, got {}",
+                                 filter_name, min_height)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        shape.min_height = min_height;
+        d.use_shape = true;
+    }
+
+    auto max_aspect = vsapi->mapGetFloat(in, "max_aspect", 0, &err);
+    if (!err) {
+        // Also rejects NaN.
+        if (!(max_aspect >= 1.0)) {
+            vsapi->mapSetError(
+                out, std::format("{}: max_aspect must be at least 1, got {}",
+                                 filter_name, max_aspect)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        shape.max_aspect = static_cast<float>(max_aspect);
+        d.use_shape = true;
+    }
+
+    auto min_fill_ratio = vsapi->mapGetFloat(in, "min_fill_ratio", 0, &err);
+    if (!err) {
+        if (!(min_fill_ratio >= 0.0 && min_fill_ratio <= 1.0)) {
+            vsapi->mapSetError(
+                out, std::format("{}: min_fill_ratio must be between 0 and 1, "
+                                 "got {}",
+                                 filter_name, min_fill_ratio)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+        shape.min_fill_ratio = static_cast<float>(min_fill_ratio);
+        d.use_shape = true;
+    }
+
+    return true;
+}
+
+static inline auto parseCommonOptions(auto in, auto out, auto core,
+                                      auto vsapi, auto& d, auto filter_name,
+                                      auto& use_8_neighbors,
+                                      auto& method) noexcept {
+    auto vi = vsapi->getVideoInfo(d.node);
+    auto err = 0;
+
+    use_8_neighbors = !!vsapi->mapGetInt(in, "neighbors8", 0, &err);
+    if (err)
+        use_8_neighbors = false;
+
+    d.write_props = !!vsapi->mapGetInt(in, "write_props", 0, &err);
+    if (err)
+        d.write_props = true;
+
+    auto num_planes = vsapi->mapNumElements(in, "planes");
+    for (auto plane = 0; plane < 3; plane++)
+        d.process[plane] = num_planes <= 0 && plane < vi->format.numPlanes;
+
+    for (auto i = 0; i < num_planes; i++) {
+        auto plane = vsapi->mapGetInt(in, "planes", i, nullptr);
+
+        if (plane < 0 || plane >= vi->format.numPlanes) {
+            vsapi->mapSetError(
+                out, std::format("{}: plane index {} is out of range",
+                                 filter_name, plane)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+
+        if (d.process[plane]) {
+            vsapi->mapSetError(out,
+                               std::format("{}: plane {} is specified twice",
+                                           filter_name, plane)
+                                   .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+
+        d.process[plane] = true;
+    }
+
+    d.processed_plane_count =
+        static_cast<int>(std::count(d.process, d.process + 3, true));
+
+    auto num_percentiles = vsapi->mapNumElements(in, "percentiles");
+    if (num_percentiles < 0) {
+        for (auto percentile = 0; percentile <= 100; percentile += 5)
+            d.percentiles.push_back(percentile);
+    }
+
+    for (auto i = 0; i < num_percentiles; i++) {
+        auto percentile = vsapi->mapGetInt(in, "percentiles", i, nullptr);
+
+        if (percentile < 0 || percentile > 100) {
+            vsapi->mapSetError(
+                out, std::format("{}: percentiles must be in the range "
+                                 "[0, 100], got {}",
+                                 filter_name, percentile)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+
+        d.percentiles.push_back(static_cast<int>(percentile));
+    }
+
+    d.params.percentiles = d.percentiles;
+    d.prop_keys = makePropKeys(d.percentiles, "");
+    for (auto plane = 0; plane < vi->format.numPlanes; plane++) {
+        d.plane_prop_keys[plane] =
+            makePropKeys(d.percentiles, std::format("_{}", plane));
+    }
+
+    auto method_value = vsapi->mapGetInt(in, "method", 0, &err);
+    if (err)
+        method_value = static_cast<int>(LabelMethod::Auto);
+
+    if (method_value < static_cast<int>(LabelMethod::Auto) ||
+        method_value > static_cast<int>(LabelMethod::Stream)) {
+        vsapi->mapSetError(
+            out, std::format("{}: method must be 0 (auto), 1 (pixel), 2 (run), "
+                             "3 (block) or 4 (stream), got {}",
+                             filter_name, method_value)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    method = static_cast<LabelMethod>(method_value);
+
+    if (method == LabelMethod::Block && !use_8_neighbors) {
+        vsapi->mapSetError(
+            out, std::format("{}: method=3 (block) requires neighbors8=True",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (!parseShapeCriteria(in, out, vsapi, d, filter_name))
+        return false;
+
+    if (!parseOutput(in, out, core, vsapi, d, filter_name))
+        return false;
+
+    d.params.min_hole_area =
+        vsapi->mapGetIntSaturated(in, "min_hole_area", 0, &err);
+    if (err)
+        d.params.min_hole_area = 0;
+
+    if (d.params.min_hole_area < 0) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_hole_area must not be negative, got {}",
+                             filter_name, d.params.min_hole_area)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.min_hole_area > 0 &&
+        d.params.output != PlaneOutput::Mask) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_hole_area is only supported with "
+                             "output=0 (mask)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.min_hole_area > 0 && method == LabelMethod::Pixel) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_hole_area is not supported by method=1 "
+                             "(pixel)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    d.params.connect_radius =
+        vsapi->mapGetIntSaturated(in, "connect_radius", 0, &err);
+    if (err)
+        d.params.connect_radius = 1;
+
+    if (d.params.connect_radius < 1 ||
+        d.params.connect_radius > MAX_CONNECT_RADIUS) {
+        vsapi->mapSetError(
+            out, std::format("{}: connect_radius must be between 1 and {}, "
+                             "got {}",
+                             filter_name, MAX_CONNECT_RADIUS,
+                             d.params.connect_radius)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.connect_radius > 1 && method == LabelMethod::Pixel) {
+        vsapi->mapSetError(
+            out, std::format("{}: connect_radius is not supported by method=1 "
+                             "(pixel)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.connect_radius > 1 && method == LabelMethod::Block) {
+        vsapi->mapSetError(
+            out, std::format("{}: connect_radius is not supported by method=3 "
+                             "(block)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    // Holes are defined by the complementary connectivity, which has no
+    // counterpart for a radius.
+    if (d.params.connect_radius > 1 && d.params.min_hole_area > 0) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_hole_area is not supported with "
+                             "connect_radius",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    d.params.stream_pixels = vsapi->mapGetInt(in, "stream_pixels", 0, &err);
+    if (err)
+        d.params.stream_pixels = DEFAULT_STREAM_PIXELS;
+
+    if (d.params.stream_pixels < 1) {
+        vsapi->mapSetError(
+            out, std::format("{}: stream_pixels must be positive, got {}",
+                             filter_name, d.params.stream_pixels)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    // Streaming labels every plane in two passes over the source and keeps
+    // no runs, which neither hole filling nor a radius can do. Planes of
+    // any size are streamed with method=4 and none with the other explicit
+    // methods; auto streams large planes when it can.
+    if (method == LabelMethod::Stream &&
+        (d.params.min_hole_area > 0 || d.params.connect_radius > 1)) {
+        vsapi->mapSetError(
+            out, std::format("{}: method=4 (stream) does not support "
+                             "min_hole_area or connect_radius",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (method == LabelMethod::Stream)
+        d.params.stream_pixels = 0;
+    else if (method != LabelMethod::Auto)
+        d.params.stream_pixels = INT64_MAX;
+
+    auto opt = vsapi->mapGetInt(in, "opt", 0, &err);
+    if (err)
+        opt = static_cast<int>(SimdLevel::Auto);
+
+    if (opt < static_cast<int>(SimdLevel::Auto) ||
+        opt > static_cast<int>(SimdLevel::NEON) ||
+        !isSimdLevelSupported(static_cast<SimdLevel>(opt))) {
+        vsapi->mapSetError(
+            out, std::format("{}: opt={} is not supported on this CPU",
+                             filter_name, opt)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    auto invert = !!vsapi->mapGetInt(in, "invert", 0, &err);
+    if (err)
+        invert = false;
+
+    // Without a threshold only samples equal to the peak value are
+    // foreground, which keeps the exact-equality scan for plain masks.
+    auto threshold = vsapi->mapGetFloat(in, "threshold", 0, &err);
+    if (err) {
+        d.params.fg_test =
+            invert ? ForegroundTest::NotEqual : ForegroundTest::Equal;
+        d.params.fg_key = d.params.fg_value;
+    } else {
+        if (!std::isfinite(threshold) ||
+            (d.sample_type == stInteger &&
+             (threshold < 0 || threshold > d.max_value))) {
+            vsapi->mapSetError(
+                out,
+                std::format("{}: threshold must be a finite value within the "
+                            "sample range, got {}",
+                            filter_name, threshold)
+                    .c_str());
+            vsapi->freeNode(d.node);
+            return false;
+        }
+
+        d.params.fg_test =
+            invert ? ForegroundTest::Below : ForegroundTest::AtLeast;
+        // Integer samples are compared against the next representable
+        // value, so a fractional threshold behaves like it would in Expr.
+        d.params.fg_key = static_cast<float>(
+            d.sample_type == stInteger ? std::ceil(threshold) : threshold);
+    }
+
+    d.params.kernels =
+        selectPlaneKernels(static_cast<SimdLevel>(opt),
+                           vi->format.bytesPerSample, d.params.fg_test);
+
+    auto threads = vsapi->mapGetInt(in, "threads", 0, &err);
+    if (err)
+        threads = 1;
+
+    if (threads < 0 || threads > MAX_THREADS) {
+        vsapi->mapSetError(
+            out, std::format("{}: threads must be between 0 and {}, got {}",
+                             filter_name, MAX_THREADS, threads)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (threads == 0) {
+        threads = std::clamp(
+            static_cast<int>(std::thread::hardware_concurrency()), 1,
+            MAX_THREADS);
+    }
+
+    d.params.threads = threads;
+
+    auto cache_size = vsapi->mapGetInt(in, "cache_size", 0, &err);
+    if (err)
+        cache_size = 0;
+
+    if (cache_size < 0) {
+        vsapi->mapSetError(
+            out, std::format("{}: cache_size must not be negative, got {}",
+                             filter_name, cache_size)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (cache_size > 0) {
+        d.cache = std::make_unique<FrameCache>(static_cast<size_t>(cache_size),
+                                               vsapi);
+    }
+
+    d.params.debug_timing = !!vsapi->mapGetInt(in, "debug_timing", 0, &err);
+    if (err)
+        d.params.debug_timing = false;
+
+    if (d.params.debug_timing)
+        d.timing_log = std::make_unique<TimingLog>();
+
+    auto temporal = !!vsapi->mapGetInt(in, "temporal", 0, &err);
+    if (err)
+        temporal = false;
+
+    // Reuse needs the runs of the previous frame, which only the run and
+    // block engines keep.
+    if (temporal &&
+        (method == LabelMethod::Pixel || method == LabelMethod::Stream)) {
+        vsapi->mapSetError(
+            out, std::format("{}: temporal is not supported by method=1 "
+                             "(pixel) or method=4 (stream)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (temporal && d.params.connect_radius > 1) {
+        vsapi->mapSetError(
+            out, std::format("{}: temporal is not supported with "
+                             "connect_radius",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (temporal)
+        d.temporal = std::make_unique<TemporalCache>(vsapi);
+
+    if (auto path = vsapi->mapGetData(in, "stats_file", 0, &err); !err) {
+        d.stats_path = path;
+        d.params.collect_records = true;
+    }
+
+    // Frames served from the cache are not labeled, and streamed planes
+    // keep no runs to list the components from.
+    if (d.params.collect_records && d.cache) {
+        vsapi->mapSetError(
+            out, std::format("{}: cache_size is not supported with stats_file",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.collect_records && method == LabelMethod::Stream) {
+        vsapi->mapSetError(
+            out, std::format("{}: stats_file is not supported by method=4 "
+                             "(stream)",
+                             filter_name)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return false;
+    }
+
+    if (d.params.collect_records)
+        d.params.stream_pixels = INT64_MAX;
+
+    if (!parseApply(in, out, vsapi, d, filter_name))
+        return false;
+
+    // Opened last, so that no file is created for invalid arguments.
+    if (d.params.collect_records) {
+        auto file = std::fopen(d.stats_path.c_str(), "wb");
+        if (!file) {
+            vsapi->mapSetError(
+                out, std::format("{}: cannot open stats_file {}", filter_name,
+                                 d.stats_path)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.apply_node);
+            vsapi->freeNode(d.fallback_node);
+            return false;
+        }
+        d.stats_writer =
+            std::make_unique<StatsWriter>(file, vi->numFrames);
+    }
+
+    return true;
+}
+
+// The clip, plus clip_apply and fallback when given. Those may be shorter
+// than the clip, in which case filterGetFrame reuses their last frame.
+static inline auto makeDependencies(const auto& d, auto vsapi) {
+    std::vector<VSFilterDependency> deps = {{d.node, rpStrictSpatial}};
+    auto num_frames = vsapi->getVideoInfo(d.node)->numFrames;
+    for (auto node : {d.apply_node, d.fallback_node}) {
+        if (node) {
+            deps.push_back({node, vsapi->getVideoInfo(node)->numFrames ==
+                                          num_frames
+                                      ? rpStrictSpatial
+                                      : rpGeneral});
+        }
+    }
+    return deps;
+}
+
+static inline auto VS_CC areaFilterCreate(const VSMap* in, VSMap* out,
+                                          [[maybe_unused]] void* userData,
+                                          VSCore* core,
+                                          const VSAPI* vsapi) noexcept {
+    // FilterData owns a mutex, so it is built in place rather than copied.
+    auto data = std::make_unique<FilterData>();
+    auto& d = *data;
+    auto err = 0;
+
+    constexpr auto filter_name = "AreaFilter";
+    d.filter_name = filter_name;
+
+    if (!validateInput(in, out, vsapi, d, filter_name)) {
+        return;
+    }
+
+    setupCommonFilterData(d, vsapi);
+
+    d.params.min_area = vsapi->mapGetInt(in, "min_area", 0, &err);
+    if (err) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_area must be set", filter_name).c_str());
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.params.min_area <= 0) {
+        vsapi->mapSetError(
+            out, std::format("{}: min_area must be greater than 0, got {}",
+                             filter_name, d.params.min_area)
+                     .c_str());
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    auto use_8_neighbors = false;
+    auto method = LabelMethod::Auto;
+    if (!parseCommonOptions(in, out, core, vsapi, d, filter_name,
+                            use_8_neighbors, method)) {
+        return;
+    }
+
+    selectProcessFunction(d, use_8_neighbors, false, method);
+
+    auto vi = *vsapi->getVideoInfo(d.node);
+    vi.format = d.output_format;
+
+    auto deps = makeDependencies(d, vsapi);
+    vsapi->createVideoFilter(out, filter_name, &vi, filterGetFrame,
+                             filterFree, fmParallel, deps.data(),
+                             static_cast<int>(deps.size()), data.release(),
+                             core);
+}
+
+static inline auto VS_CC relFilterCreate(auto in, auto out,
+                                         [[maybe_unused]] auto userData,
+                                         auto core, auto vsapi) noexcept {
+    // FilterData owns a mutex, so it is built in place rather than copied.
+    auto data = std::make_unique<FilterData>();
+    auto& d = *data;
+    auto err = 0;
+
+    constexpr auto filter_name = "RelFilter";
+    d.filter_name = filter_name;
+
+    if (!validateInput(in, out, vsapi, d, filter_name)) {
+        return;
+    }
+
+    setupCommonFilterData(d, vsapi);
+
+    d.params.percentage =
         static_cast<float>(vsapi->mapGetFloat(in, "percentage", 0, &err));
     if (err) {
         vsapi->mapSetError(out,
                            std::format("{}: percentage must be set, got {}",
-                                       filter_name, d.percentage)
+                                       filter_name, d.params.percentage)
                                .c_str());
         vsapi->freeNode(d.node);
         return;
     }
 
-    if (d.percentage <= 0.0f || d.percentage > 100.0f) {
+    if (d.params.percentage <= 0.0f || d.params.percentage > 100.0f) {
         vsapi->mapSetError(
             out, std::format("{}: percentage must be in the range (0, 100], "
                              "got {}",
-                             filter_name, d.percentage)
+                             filter_name, d.params.percentage)
                      .c_str());
         vsapi->freeNode(d.node);
         return;
     }
 
-    auto use_8_neighbors = !!vsapi->mapGetInt(in, "neighbors8", 0, &err);
-    if (err)
-        use_8_neighbors = false;
+    auto use_8_neighbors = false;
+    auto method = LabelMethod::Auto;
+    if (!parseCommonOptions(in, out, core, vsapi, d, filter_name,
+                            use_8_neighbors, method)) {
+        return;
+    }
 
-    d.write_props = !!vsapi->mapGetInt(in, "write_props", 0, &err);
-    if (err)
-        d.write_props = true;
+    selectProcessFunction(d, use_8_neighbors, true, method);
+
+    auto vi = *vsapi->getVideoInfo(d.node);
+    vi.format = d.output_format;
+
+    auto deps = makeDependencies(d, vsapi);
+    vsapi->createVideoFilter(out, filter_name, &vi, filterGetFrame,
+                             filterFree, fmParallel, deps.data(),
+                             static_cast<int>(deps.size()), data.release(),
+                             core);
+}
 
-    selectProcessFunction(d, use_8_neighbors, true);
+template <typename A>
+static inline ThresholdPlaneFn selectThresholdFunction(auto& d) {
+    if (d.sample_type == stInteger) {
+        if (d.bits_per_sample == 8)
+            return thresholdPlaneWrapper<A, uint8_t>;
+        return thresholdPlaneWrapper<A, uint16_t>;
+    }
+    return thresholdPlaneWrapper<A, float>;
+}
 
-    data = static_cast<FilterData*>(malloc(sizeof(d)));
-    *data = d;
+// Labels once into an area map and derives one mask per min_area from it.
+// The area map node has one consumer per output, so VapourSynth caches its
+// frames and each source frame is fetched and labeled once.
+static inline auto VS_CC multiAreaFilterCreate(auto in, auto out,
+                                               [[maybe_unused]] auto userData,
+                                               auto core,
+                                               auto vsapi) noexcept {
+    // FilterData owns a mutex, so it is built in place rather than copied.
+    auto data = std::make_unique<FilterData>();
+    auto& d = *data;
 
-    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}};
-    vsapi->createVideoFilter(out, filter_name, vsapi->getVideoInfo(d.node),
-                             relFilterGetFrame, filterFree, fmParallel, deps, 1,
-                             data, core);
+    constexpr auto filter_name = "MultiAreaFilter";
+    d.filter_name = filter_name;
+
+    if (!validateInput(in, out, vsapi, d, filter_name)) {
+        return;
+    }
+
+    setupCommonFilterData(d, vsapi);
+
+    std::vector<uint32_t> min_areas;
+    auto num_min_areas = vsapi->mapNumElements(in, "min_area");
+    for (auto i = 0; i < num_min_areas; i++) {
+        auto min_area = vsapi->mapGetIntSaturated(in, "min_area", i, nullptr);
+        if (min_area <= 0) {
+            vsapi->mapSetError(
+                out, std::format("{}: min_area must be greater than 0, got {}",
+                                 filter_name, min_area)
+                         .c_str());
+            vsapi->freeNode(d.node);
+            return;
+        }
+        min_areas.push_back(static_cast<uint32_t>(min_area));
+    }
+
+    // Components below the smallest threshold are removed from the area
+    // map already, as no output keeps them.
+    d.params.min_area =
+        static_cast<int>(*std::min_element(min_areas.begin(), min_areas.end()));
+
+    auto use_8_neighbors = false;
+    auto method = LabelMethod::Auto;
+    if (!parseCommonOptions(in, out, core, vsapi, d, filter_name,
+                            use_8_neighbors, method)) {
+        return;
+    }
+
+    // Areas saturate at 65535 in a 16 bit map, which still compares
+    // correctly against thresholds up to that value.
+    auto max_min_area = *std::max_element(min_areas.begin(), min_areas.end());
+    auto area_bits = max_min_area <= UINT16_MAX ? 16 : 32;
+    setupOutput(d, PlaneOutput::Area, area_bits, core, vsapi);
+
+    selectProcessFunction(d, use_8_neighbors, false, method);
+
+    auto threshold_plane_fn = area_bits == 16
+                                  ? selectThresholdFunction<uint16_t>(d)
+                                  : selectThresholdFunction<uint32_t>(d);
+    auto source_vi = *vsapi->getVideoInfo(d.node);
+    auto pass_through = d.processed_plane_count < source_vi.format.numPlanes;
+    auto source = vsapi->addNodeRef(d.node);
+
+    auto areas_vi = source_vi;
+    areas_vi.format = d.output_format;
+
+    ThresholdData base = {};
+    base.fg_value = d.params.fg_value;
+    base.format = source_vi.format;
+    std::copy(d.process, d.process + 3, base.process);
+    base.threshold_plane_fn = threshold_plane_fn;
+
+    VSFilterDependency area_deps[] = {{d.node, rpStrictSpatial}};
+    auto areas = vsapi->createVideoFilter2(filter_name, &areas_vi,
+                                           filterGetFrame, filterFree,
+                                           fmParallel, area_deps, 1,
+                                           data.release(), core);
+
+    for (auto min_area : min_areas) {
+        auto output = std::make_unique<ThresholdData>(base);
+        output->min_area = min_area;
+        output->areas = vsapi->addNodeRef(areas);
+        output->node = pass_through ? vsapi->addNodeRef(source) : nullptr;
+
+        VSFilterDependency deps[] = {{output->areas, rpStrictSpatial},
+                                     {output->node, rpStrictSpatial}};
+        vsapi->createVideoFilter(out, filter_name, &source_vi,
+                                 thresholdGetFrame, thresholdFree, fmParallel,
+                                 deps, pass_through ? 2 : 1, output.release(),
+                                 core);
+    }
+
+    vsapi->freeNode(areas);
+    vsapi->freeNode(source);
 }
 
 VS_EXTERNAL_API(void)
@@ -589,10 +2122,36 @@ VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI* vspapi) {
                          plugin);
     vspapi->registerFunction(
         "AreaFilter",
-        "clip:vnode;min_area:int;neighbors8:int:opt;write_props:int:opt;",
+        "clip:vnode;min_area:int;neighbors8:int:opt;write_props:int:opt;"
+        "method:int:opt;opt:int:opt;threads:int:opt;threshold:float:opt;"
+        "invert:int:opt;planes:int[]:opt;percentiles:int[]:opt;"
+        "min_hole_area:int:opt;max_area:int:opt;min_width:int:opt;"
+        "min_height:int:opt;max_aspect:float:opt;min_fill_ratio:float:opt;"
+        "output:int:opt;output_bits:int:opt;cache_size:int:opt;"
+        "connect_radius:int:opt;stream_pixels:int:opt;debug_timing:int:opt;"
+        "temporal:int:opt;stats_file:data:opt;clip_apply:vnode:opt;"
+        "fallback:vnode:opt;fallback_value:float:opt;",
         "clip:vnode;", areaFilterCreate, NULL, plugin);
     vspapi->registerFunction(
         "RelFilter",
-        "clip:vnode;percentage:float;neighbors8:int:opt;write_props:int:opt;",
+        "clip:vnode;percentage:float;neighbors8:int:opt;write_props:int:opt;"
+        "method:int:opt;opt:int:opt;threads:int:opt;threshold:float:opt;"
+        "invert:int:opt;planes:int[]:opt;percentiles:int[]:opt;"
+        "min_hole_area:int:opt;max_area:int:opt;min_width:int:opt;"
+        "min_height:int:opt;max_aspect:float:opt;min_fill_ratio:float:opt;"
+        "output:int:opt;output_bits:int:opt;cache_size:int:opt;"
+        "connect_radius:int:opt;stream_pixels:int:opt;debug_timing:int:opt;"
+        "temporal:int:opt;stats_file:data:opt;clip_apply:vnode:opt;"
+        "fallback:vnode:opt;fallback_value:float:opt;",
         "clip:vnode;", relFilterCreate, NULL, plugin);
+    vspapi->registerFunction(
+        "MultiAreaFilter",
+        "clip:vnode;min_area:int[];neighbors8:int:opt;write_props:int:opt;"
+        "method:int:opt;opt:int:opt;threads:int:opt;threshold:float:opt;"
+        "invert:int:opt;planes:int[]:opt;percentiles:int[]:opt;"
+        "max_area:int:opt;min_width:int:opt;min_height:int:opt;"
+        "max_aspect:float:opt;min_fill_ratio:float:opt;cache_size:int:opt;"
+        "connect_radius:int:opt;stream_pixels:int:opt;debug_timing:int:opt;"
+        "temporal:int:opt;",
+        "clip:vnode[];", multiAreaFilterCreate, NULL, plugin);
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "kernels.hpp"
+#include "kernels_impl.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#define AREAFILTER_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define AREAFILTER_ARM64 1
+#endif
+
+template <ForegroundTest test, typename T>
+static int scanRuns(const void* row, int width, float key,
+                    Run* runs) noexcept {
+    return scanRunsScalar<test>(static_cast<const T*>(row), width,
+                                static_cast<T>(key), runs);
+}
+
+template <typename T>
+static void fillSpan(void* dst, size_t count, float value) noexcept {
+    fillSpanScalar(static_cast<T*>(dst), count, static_cast<T>(value));
+}
+
+PlaneKernels getPlaneKernelsScalar(int bytes_per_sample,
+                                   ForegroundTest test) noexcept {
+    return withForegroundTest(test, [=](auto t) -> PlaneKernels {
+        constexpr auto fg_test = decltype(t)::value;
+        switch (bytes_per_sample) {
+        case 1:
+            return {scanRuns<fg_test, uint8_t>, fillSpan<uint8_t>};
+        case 2:
+            return {scanRuns<fg_test, uint16_t>, fillSpan<uint16_t>};
+        default:
+            return {scanRuns<fg_test, float>, fillSpan<float>};
+        }
+    });
+}
+
+#ifdef AREAFILTER_X86
+static bool cpuHasAVX2() noexcept {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    auto osxsave = (info[2] & (1 << 27)) != 0;
+    auto avx = (info[2] & (1 << 28)) != 0;
+    // The OS must save the upper halves of the ymm registers.
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+bool isSimdLevelSupported(SimdLevel level) noexcept {
+    switch (level) {
+    case SimdLevel::Auto:
+    case SimdLevel::Scalar:
+        return true;
+#ifdef AREAFILTER_X86
+    case SimdLevel::SSE2:
+        return true;
+    case SimdLevel::AVX2:
+        return cpuHasAVX2();
+#endif
+#ifdef AREAFILTER_ARM64
+    case SimdLevel::NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+SimdLevel detectSimdLevel() noexcept {
+    for (auto level : {SimdLevel::AVX2, SimdLevel::SSE2, SimdLevel::NEON}) {
+        if (isSimdLevelSupported(level))
+            return level;
+    }
+    return SimdLevel::Scalar;
+}
+
+PlaneKernels selectPlaneKernels(SimdLevel level, int bytes_per_sample,
+                                ForegroundTest test) noexcept {
+    if (level == SimdLevel::Auto)
+        level = detectSimdLevel();
+
+    switch (level) {
+#ifdef AREAFILTER_X86
+    case SimdLevel::SSE2:
+        return getPlaneKernelsSSE2(bytes_per_sample, test);
+    case SimdLevel::AVX2:
+        return getPlaneKernelsAVX2(bytes_per_sample, test);
+#endif
+#ifdef AREAFILTER_ARM64
+    case SimdLevel::NEON:
+        return getPlaneKernelsNEON(bytes_per_sample, test);
+#endif
+    default:
+        return getPlaneKernelsScalar(bytes_per_sample, test);
+    }
+}
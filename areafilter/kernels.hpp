@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Values match the `opt` filter argument.
+enum class SimdLevel { Auto = 0, Scalar = 1, SSE2 = 2, AVX2 = 3, NEON = 4 };
+
+// How a sample is compared against the foreground key. NotEqual and Below are
+// the exact complements of Equal and AtLeast (NaN counts as Below).
+enum class ForegroundTest { Equal, NotEqual, AtLeast, Below };
+
+template <ForegroundTest test, typename T>
+static inline bool isForeground(T value, T key) noexcept {
+    if constexpr (test == ForegroundTest::Equal)
+        return value == key;
+    else if constexpr (test == ForegroundTest::NotEqual)
+        return value != key;
+    else if constexpr (test == ForegroundTest::AtLeast)
+        return value >= key;
+    else
+        return !(value >= key);
+}
+
+// Calls `fn` with std::integral_constant<ForegroundTest, test>, so code paths
+// can be specialised per test without templating every caller on it.
+template <typename Fn>
+static inline decltype(auto) withForegroundTest(ForegroundTest test,
+                                                Fn&& fn) {
+    using enum ForegroundTest;
+    switch (test) {
+    case NotEqual:
+        return fn(std::integral_constant<ForegroundTest, NotEqual>{});
+    case AtLeast:
+        return fn(std::integral_constant<ForegroundTest, AtLeast>{});
+    case Below:
+        return fn(std::integral_constant<ForegroundTest, Below>{});
+    default:
+        return fn(std::integral_constant<ForegroundTest, Equal>{});
+    }
+}
+
+// A horizontal span [start, end) of foreground pixels within one row.
+struct Run {
+    int start, end;
+    int label;
+};
+
+// Appends the foreground runs of one row to `runs` and returns how many were
+// written. Samples are compared against `key` with the ForegroundTest the
+// function was selected for. `runs` must have room for (width + 1) / 2
+// entries.
+typedef int (*ScanRunsFn)(const void* row, int width, float key, Run* runs);
+
+// Sets `count` consecutive samples starting at `dst` to `value`.
+typedef void (*FillSpanFn)(void* dst, size_t count, float value);
+
+struct PlaneKernels {
+    ScanRunsFn scan_runs;
+    FillSpanFn fill_span;
+};
+
+bool isSimdLevelSupported(SimdLevel level) noexcept;
+
+// Highest level supported by the running CPU.
+SimdLevel detectSimdLevel() noexcept;
+
+PlaneKernels selectPlaneKernels(SimdLevel level, int bytes_per_sample,
+                                ForegroundTest test) noexcept;
+
+PlaneKernels getPlaneKernelsScalar(int bytes_per_sample,
+                                   ForegroundTest test) noexcept;
+PlaneKernels getPlaneKernelsSSE2(int bytes_per_sample,
+                                 ForegroundTest test) noexcept;
+PlaneKernels getPlaneKernelsAVX2(int bytes_per_sample,
+                                 ForegroundTest test) noexcept;
+PlaneKernels getPlaneKernelsNEON(int bytes_per_sample,
+                                 ForegroundTest test) noexcept;
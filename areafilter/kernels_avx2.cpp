@@ -0,0 +1,136 @@
+#include "kernels.hpp"
+#include "kernels_impl.hpp"
+#include <immintrin.h>
+
+static inline uint64_t movemask32(__m256i bytes) noexcept {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(bytes));
+}
+
+// v >= key for unsigned samples, see kernels_sse2.cpp.
+template <ForegroundTest test>
+static inline __m256i compareU8(__m256i v, __m256i key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm256_cmpeq_epi8(v, key);
+    else
+        return _mm256_cmpeq_epi8(_mm256_max_epu8(v, key), v);
+}
+
+template <ForegroundTest test>
+static inline __m256i compareU16(__m256i v, __m256i key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm256_cmpeq_epi16(v, key);
+    else
+        return _mm256_cmpeq_epi16(_mm256_subs_epu16(key, v),
+                                  _mm256_setzero_si256());
+}
+
+template <ForegroundTest test>
+static inline __m256 compareF32(__m256 v, __m256 key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm256_cmp_ps(v, key, _CMP_EQ_OQ);
+    else
+        return _mm256_cmp_ps(v, key, _CMP_GE_OQ);
+}
+
+template <ForegroundTest test>
+static int scanRunsU8(const void* row, int width, float key,
+                      Run* runs) noexcept {
+    auto k = static_cast<uint8_t>(key);
+    auto key_vec = _mm256_set1_epi8(static_cast<char>(k));
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint8_t*>(row), width, k, runs,
+        [key_vec](const uint8_t* p) {
+            auto lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            auto hi =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+            return movemask32(compareU8<test>(lo, key_vec)) |
+                   movemask32(compareU8<test>(hi, key_vec)) << 32;
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsU16(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto k = static_cast<uint16_t>(key);
+    auto key_vec = _mm256_set1_epi16(static_cast<short>(k));
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint16_t*>(row), width, k, runs,
+        [key_vec](const uint16_t* p) {
+            auto mask = uint64_t{0};
+            for (auto i = 0; i < 2; i++) {
+                auto lo = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(p + i * 32));
+                auto hi = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(p + i * 32 + 16));
+                // packs works within 128-bit lanes; restore sample order.
+                auto eq = _mm256_packs_epi16(compareU16<test>(lo, key_vec),
+                                             compareU16<test>(hi, key_vec));
+                eq = _mm256_permute4x64_epi64(eq, _MM_SHUFFLE(3, 1, 2, 0));
+                mask |= movemask32(eq) << (i * 32);
+            }
+            return mask;
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsF32(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto key_vec = _mm256_set1_ps(key);
+    auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    return scanRunsBlocked<test>(
+        static_cast<const float*>(row), width, key, runs,
+        [key_vec, order](const float* p) {
+            auto mask = uint64_t{0};
+            for (auto i = 0; i < 2; i++) {
+                __m256i eq[4];
+                for (auto j = 0; j < 4; j++) {
+                    eq[j] = _mm256_castps_si256(compareF32<test>(
+                        _mm256_loadu_ps(p + i * 32 + j * 8), key_vec));
+                }
+                auto bytes =
+                    _mm256_packs_epi16(_mm256_packs_epi32(eq[0], eq[1]),
+                                       _mm256_packs_epi32(eq[2], eq[3]));
+                bytes = _mm256_permutevar8x32_epi32(bytes, order);
+                mask |= movemask32(bytes) << (i * 32);
+            }
+            return mask;
+        });
+}
+
+static void fillSpanU8(void* dst, size_t count, float value) noexcept {
+    fillSpanScalar(static_cast<uint8_t*>(dst), count,
+                   static_cast<uint8_t>(value));
+}
+
+static void fillSpanU16(void* dst, size_t count, float value) noexcept {
+    auto v = static_cast<uint16_t>(value);
+    auto vec = _mm256_set1_epi16(static_cast<short>(v));
+    fillSpanBlocked<16>(
+        static_cast<uint16_t*>(dst), count, v, [vec](uint16_t* p) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), vec);
+        });
+}
+
+static void fillSpanF32(void* dst, size_t count, float value) noexcept {
+    auto vec = _mm256_set1_ps(value);
+    fillSpanBlocked<8>(static_cast<float*>(dst), count, value,
+                       [vec](float* p) { _mm256_storeu_ps(p, vec); });
+}
+
+PlaneKernels getPlaneKernelsAVX2(int bytes_per_sample,
+                                 ForegroundTest test) noexcept {
+    return withForegroundTest(test, [=](auto t) -> PlaneKernels {
+        constexpr auto fg_test = decltype(t)::value;
+        switch (bytes_per_sample) {
+        case 1:
+            return {scanRunsU8<fg_test>, fillSpanU8};
+        case 2:
+            return {scanRunsU16<fg_test>, fillSpanU16};
+        default:
+            return {scanRunsF32<fg_test>, fillSpanF32};
+        }
+    });
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Shared building blocks for the per-ISA kernel translation units. Each of
+// them includes this header and instantiates the templates with its own
+// mask and store primitives, so everything inlines under that unit's flags.
+
+#include "kernels.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+// SIMD kernels only implement the Equal and AtLeast comparisons and
+// complement the resulting mask for the other two tests.
+template <ForegroundTest test>
+constexpr auto invertsMask =
+    test == ForegroundTest::NotEqual || test == ForegroundTest::Below;
+
+template <ForegroundTest test>
+constexpr auto comparesEqual =
+    test == ForegroundTest::Equal || test == ForegroundTest::NotEqual;
+
+// Converts per-pixel foreground bits into runs. `mask64` returns a bitmask
+// for 64 consecutive samples (bit i set when sample i is foreground), which
+// lets empty and completely filled blocks be skipped without a single
+// per-pixel branch.
+template <ForegroundTest test, typename T>
+static inline auto scanRunsBlocked(const T* row, int width, T key, Run* runs,
+                                   auto mask64) noexcept {
+    auto count = 0;
+    auto in_run = false;
+    auto start = 0;
+    auto x = 0;
+
+    for (; x + 64 <= width; x += 64) {
+        auto mask = mask64(row + x);
+        if constexpr (invertsMask<test>)
+            mask = ~mask;
+        // A set bit marks a column where the foreground state changes.
+        auto edges = mask ^ ((mask << 1) | static_cast<uint64_t>(in_run));
+
+        while (edges) {
+            auto column = x + std::countr_zero(edges);
+            edges &= edges - 1;
+
+            if (in_run)
+                runs[count++] = {start, column, 0};
+            else
+                start = column;
+            in_run = !in_run;
+        }
+    }
+
+    for (; x < width; x++) {
+        auto fg = isForeground<test>(row[x], key);
+        if (fg == in_run)
+            continue;
+
+        if (in_run)
+            runs[count++] = {start, x, 0};
+        else
+            start = x;
+        in_run = fg;
+    }
+
+    if (in_run)
+        runs[count++] = {start, width, 0};
+
+    return count;
+}
+
+template <ForegroundTest test, typename T>
+static inline auto scanRunsScalar(const T* row, int width, T key,
+                                  Run* runs) noexcept {
+    auto count = 0;
+
+    for (auto x = 0; x < width; x++) {
+        if (!isForeground<test>(row[x], key))
+            continue;
+
+        auto start = x;
+        while (x < width && isForeground<test>(row[x], key))
+            x++;
+        runs[count++] = {start, x, 0};
+    }
+
+    return count;
+}
+
+// Writes `count` samples with `store(dst, vector)` in blocks of `lanes` and
+// finishes the remainder with scalar stores.
+template <int lanes, typename T>
+static inline auto fillSpanBlocked(T* dst, size_t count, T value,
+                                   auto store) noexcept {
+    auto i = size_t{0};
+    for (; i + lanes <= count; i += lanes)
+        store(dst + i);
+    std::fill(dst + i, dst + count, value);
+}
+
+template <typename T>
+static inline auto fillSpanScalar(T* dst, size_t count, T value) noexcept {
+    if constexpr (sizeof(T) == 1)
+        std::memset(dst, value, count);
+    else
+        std::fill(dst, dst + count, value);
+}
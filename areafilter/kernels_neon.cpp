@@ -0,0 +1,139 @@
+#include "kernels.hpp"
+#include "kernels_impl.hpp"
+#include <arm_neon.h>
+
+// NEON has no movemask; weight each comparison byte by its bit position and
+// fold four vectors together with pairwise adds.
+static inline uint64_t movemask64(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2,
+                                  uint8x16_t m3) noexcept {
+    static constexpr uint8_t bit_weights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                                1, 2, 4, 8, 16, 32, 64, 128};
+    auto weights = vld1q_u8(bit_weights);
+    auto sum0 = vpaddq_u8(vandq_u8(m0, weights), vandq_u8(m1, weights));
+    auto sum1 = vpaddq_u8(vandq_u8(m2, weights), vandq_u8(m3, weights));
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+static inline uint8x16_t narrow16(uint16x8_t lo, uint16x8_t hi) noexcept {
+    return vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+}
+
+static inline uint8x16_t narrow32(uint32x4_t a, uint32x4_t b, uint32x4_t c,
+                                  uint32x4_t d) noexcept {
+    return narrow16(vcombine_u16(vmovn_u32(a), vmovn_u32(b)),
+                    vcombine_u16(vmovn_u32(c), vmovn_u32(d)));
+}
+
+template <ForegroundTest test>
+static inline uint8x16_t compareU8(uint8x16_t v, uint8x16_t key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return vceqq_u8(v, key);
+    else
+        return vcgeq_u8(v, key);
+}
+
+template <ForegroundTest test>
+static inline uint16x8_t compareU16(uint16x8_t v, uint16x8_t key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return vceqq_u16(v, key);
+    else
+        return vcgeq_u16(v, key);
+}
+
+template <ForegroundTest test>
+static inline uint32x4_t compareF32(float32x4_t v, float32x4_t key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return vceqq_f32(v, key);
+    else
+        return vcgeq_f32(v, key);
+}
+
+template <ForegroundTest test>
+static int scanRunsU8(const void* row, int width, float key,
+                      Run* runs) noexcept {
+    auto k = static_cast<uint8_t>(key);
+    auto key_vec = vdupq_n_u8(k);
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint8_t*>(row), width, k, runs,
+        [key_vec](const uint8_t* p) {
+            return movemask64(compareU8<test>(vld1q_u8(p), key_vec),
+                              compareU8<test>(vld1q_u8(p + 16), key_vec),
+                              compareU8<test>(vld1q_u8(p + 32), key_vec),
+                              compareU8<test>(vld1q_u8(p + 48), key_vec));
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsU16(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto k = static_cast<uint16_t>(key);
+    auto key_vec = vdupq_n_u16(k);
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint16_t*>(row), width, k, runs,
+        [key_vec](const uint16_t* p) {
+            uint8x16_t eq[4];
+            for (auto i = 0; i < 4; i++) {
+                eq[i] = narrow16(
+                    compareU16<test>(vld1q_u16(p + i * 16), key_vec),
+                    compareU16<test>(vld1q_u16(p + i * 16 + 8), key_vec));
+            }
+            return movemask64(eq[0], eq[1], eq[2], eq[3]);
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsF32(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto key_vec = vdupq_n_f32(key);
+
+    return scanRunsBlocked<test>(
+        static_cast<const float*>(row), width, key, runs,
+        [key_vec](const float* p) {
+            uint8x16_t eq[4];
+            for (auto i = 0; i < 4; i++) {
+                auto q = p + i * 16;
+                eq[i] = narrow32(compareF32<test>(vld1q_f32(q), key_vec),
+                                 compareF32<test>(vld1q_f32(q + 4), key_vec),
+                                 compareF32<test>(vld1q_f32(q + 8), key_vec),
+                                 compareF32<test>(vld1q_f32(q + 12), key_vec));
+            }
+            return movemask64(eq[0], eq[1], eq[2], eq[3]);
+        });
+}
+
+static void fillSpanU8(void* dst, size_t count, float value) noexcept {
+    fillSpanScalar(static_cast<uint8_t*>(dst), count,
+                   static_cast<uint8_t>(value));
+}
+
+static void fillSpanU16(void* dst, size_t count, float value) noexcept {
+    auto v = static_cast<uint16_t>(value);
+    auto vec = vdupq_n_u16(v);
+    fillSpanBlocked<8>(static_cast<uint16_t*>(dst), count, v,
+                       [vec](uint16_t* p) { vst1q_u16(p, vec); });
+}
+
+static void fillSpanF32(void* dst, size_t count, float value) noexcept {
+    auto vec = vdupq_n_f32(value);
+    fillSpanBlocked<4>(static_cast<float*>(dst), count, value,
+                       [vec](float* p) { vst1q_f32(p, vec); });
+}
+
+PlaneKernels getPlaneKernelsNEON(int bytes_per_sample,
+                                 ForegroundTest test) noexcept {
+    return withForegroundTest(test, [=](auto t) -> PlaneKernels {
+        constexpr auto fg_test = decltype(t)::value;
+        switch (bytes_per_sample) {
+        case 1:
+            return {scanRunsU8<fg_test>, fillSpanU8};
+        case 2:
+            return {scanRunsU16<fg_test>, fillSpanU16};
+        default:
+            return {scanRunsF32<fg_test>, fillSpanF32};
+        }
+    });
+}
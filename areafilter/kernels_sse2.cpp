@@ -0,0 +1,135 @@
+#include "kernels.hpp"
+#include "kernels_impl.hpp"
+#include <emmintrin.h>
+
+static inline uint64_t movemask16(__m128i bytes) noexcept {
+    return static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+}
+
+// SSE2 has no unsigned comparisons; v >= key is tested as max(v, key) == v
+// for bytes and as saturate(key - v) == 0 for words.
+template <ForegroundTest test>
+static inline __m128i compareU8(__m128i v, __m128i key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm_cmpeq_epi8(v, key);
+    else
+        return _mm_cmpeq_epi8(_mm_max_epu8(v, key), v);
+}
+
+template <ForegroundTest test>
+static inline __m128i compareU16(__m128i v, __m128i key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm_cmpeq_epi16(v, key);
+    else
+        return _mm_cmpeq_epi16(_mm_subs_epu16(key, v), _mm_setzero_si128());
+}
+
+template <ForegroundTest test>
+static inline __m128 compareF32(__m128 v, __m128 key) noexcept {
+    if constexpr (comparesEqual<test>)
+        return _mm_cmpeq_ps(v, key);
+    else
+        return _mm_cmpge_ps(v, key);
+}
+
+template <ForegroundTest test>
+static int scanRunsU8(const void* row, int width, float key,
+                      Run* runs) noexcept {
+    auto k = static_cast<uint8_t>(key);
+    auto key_vec = _mm_set1_epi8(static_cast<char>(k));
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint8_t*>(row), width, k, runs,
+        [key_vec](const uint8_t* p) {
+            auto mask = uint64_t{0};
+            for (auto i = 0; i < 4; i++) {
+                auto v = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(p + i * 16));
+                mask |= movemask16(compareU8<test>(v, key_vec)) << (i * 16);
+            }
+            return mask;
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsU16(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto k = static_cast<uint16_t>(key);
+    auto key_vec = _mm_set1_epi16(static_cast<short>(k));
+
+    return scanRunsBlocked<test>(
+        static_cast<const uint16_t*>(row), width, k, runs,
+        [key_vec](const uint16_t* p) {
+            auto mask = uint64_t{0};
+            for (auto i = 0; i < 4; i++) {
+                auto lo = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(p + i * 16));
+                auto hi = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(p + i * 16 + 8));
+                // Comparison results are 0 or -1, so signed saturation keeps
+                // them intact while narrowing to bytes.
+                auto eq = _mm_packs_epi16(compareU16<test>(lo, key_vec),
+                                          compareU16<test>(hi, key_vec));
+                mask |= movemask16(eq) << (i * 16);
+            }
+            return mask;
+        });
+}
+
+template <ForegroundTest test>
+static int scanRunsF32(const void* row, int width, float key,
+                       Run* runs) noexcept {
+    auto key_vec = _mm_set1_ps(key);
+
+    return scanRunsBlocked<test>(
+        static_cast<const float*>(row), width, key, runs,
+        [key_vec](const float* p) {
+            auto mask = uint64_t{0};
+            for (auto i = 0; i < 4; i++) {
+                __m128i eq[4];
+                for (auto j = 0; j < 4; j++) {
+                    eq[j] = _mm_castps_si128(compareF32<test>(
+                        _mm_loadu_ps(p + i * 16 + j * 4), key_vec));
+                }
+                auto bytes = _mm_packs_epi16(_mm_packs_epi32(eq[0], eq[1]),
+                                             _mm_packs_epi32(eq[2], eq[3]));
+                mask |= movemask16(bytes) << (i * 16);
+            }
+            return mask;
+        });
+}
+
+static void fillSpanU8(void* dst, size_t count, float value) noexcept {
+    fillSpanScalar(static_cast<uint8_t*>(dst), count,
+                   static_cast<uint8_t>(value));
+}
+
+static void fillSpanU16(void* dst, size_t count, float value) noexcept {
+    auto v = static_cast<uint16_t>(value);
+    auto vec = _mm_set1_epi16(static_cast<short>(v));
+    fillSpanBlocked<8>(static_cast<uint16_t*>(dst), count, v,
+                       [vec](uint16_t* p) {
+                           _mm_storeu_si128(reinterpret_cast<__m128i*>(p), vec);
+                       });
+}
+
+static void fillSpanF32(void* dst, size_t count, float value) noexcept {
+    auto vec = _mm_set1_ps(value);
+    fillSpanBlocked<4>(static_cast<float*>(dst), count, value,
+                       [vec](float* p) { _mm_storeu_ps(p, vec); });
+}
+
+PlaneKernels getPlaneKernelsSSE2(int bytes_per_sample,
+                                 ForegroundTest test) noexcept {
+    return withForegroundTest(test, [=](auto t) -> PlaneKernels {
+        constexpr auto fg_test = decltype(t)::value;
+        switch (bytes_per_sample) {
+        case 1:
+            return {scanRunsU8<fg_test>, fillSpanU8};
+        case 2:
+            return {scanRunsU16<fg_test>, fillSpanU16};
+        default:
+            return {scanRunsF32<fg_test>, fillSpanF32};
+        }
+    });
+}
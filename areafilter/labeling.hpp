@@ -0,0 +1,1977 @@
+#pragma once
+
+// The labeling engines. Nothing in here depends on the VapourSynth API, so
+// the engines can be driven directly, e.g. by the benchmark in bench/.
+
+#include "kernels.hpp"
+#include <algorithm>
+#include <barrier>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Same definition as VSHelper4.h, for users that do not include it.
+#ifndef VS_RESTRICT
+#define VS_RESTRICT __restrict
+#endif
+
+typedef struct {
+    int component_count;
+    // One entry per requested percentile, in the order they were requested.
+    std::vector<int> size_percentiles;
+} ComponentStats;
+
+// Limits on the shape of kept components, applied on top of the size test.
+// They are only evaluated by engines instantiated with use_shape; the
+// defaults let everything through.
+struct ShapeCriteria {
+    int max_area = INT_MAX;
+    int min_width = 0;
+    int min_height = 0;
+    // Longer over shorter side of the bounding box.
+    float max_aspect = INFINITY;
+    // Area over bounding box area.
+    float min_fill_ratio = 0.0f;
+};
+
+// What the engines write for the pixels of kept components. Values match the
+// `output` filter argument. Label writes compact component IDs, 1, 2, ... in
+// raster order of each component's first pixel; Area writes the component's
+// size. Both saturate to the destination type. Background and removed
+// components are 0 in every mode.
+enum class PlaneOutput { Mask = 0, Label = 1, Area = 2 };
+
+// Output plane of an engine. The engines ask for it through an
+// `acquire_dst(all_kept)` callable only once labeling is done, passing
+// whether every foreground pixel is kept. A null `data` means the caller
+// reuses the source plane and nothing is written.
+//
+// With a non-null `apply`, a mask output is merged in the same pass: kept
+// pixels are copied from `apply` instead of being set to fg_value, and all
+// other pixels from `fallback`, or set to `fallback_value` when that is
+// null. Strides are in bytes.
+template <typename D> struct PlaneDestination {
+    D* data;
+    ptrdiff_t stride;
+    const D* apply = nullptr;
+    ptrdiff_t apply_stride = 0;
+    const D* fallback = nullptr;
+    ptrdiff_t fallback_stride = 0;
+    D fallback_value = 0;
+
+    // Row y of a source plane.
+    static auto row(const D* plane, ptrdiff_t stride, int y) {
+        return reinterpret_cast<const D*>(
+            reinterpret_cast<const uint8_t*>(plane) + y * stride);
+    }
+
+    // Writes what pixels [start, end) of row y get when they are not kept.
+    auto clear(D* dst_row, int y, int start, int end) const {
+        if (!apply)
+            std::memset(dst_row + start, 0, (end - start) * sizeof(D));
+        else if (fallback)
+            std::memcpy(dst_row + start,
+                        row(fallback, fallback_stride, y) + start,
+                        (end - start) * sizeof(D));
+        else
+            std::fill(dst_row + start, dst_row + end, fallback_value);
+    }
+};
+
+typedef struct {
+    union {
+        int min_area;
+        float percentage;
+    };
+    ShapeCriteria shape;
+    // Background components smaller than this that do not touch the border
+    // are filled. 0 disables hole filling.
+    int min_hole_area;
+    // Components closer than this are joined, see labelRunsWithin. 1 is the
+    // plain neighborhood.
+    int connect_radius;
+    // Planes of at least this many pixels are labeled by streaming, see
+    // processPlaneRuns.
+    int64_t stream_pixels;
+    // Value written for kept pixels with PlaneOutput::Mask.
+    float fg_value;
+    PlaneOutput output;
+    // Samples are foreground when fg_test(sample, fg_key) holds.
+    ForegroundTest fg_test;
+    float fg_key;
+    int threads;
+    // Percentiles reported in ComponentStats::size_percentiles.
+    std::span<const int> percentiles;
+    PlaneKernels kernels;
+    // Run the engines with PlaneTimer, see PlaneScratch::timings.
+    bool debug_timing;
+    // List the components in PlaneScratch::records.
+    bool collect_records;
+} PlaneParams;
+
+// Union-find over provisional labels. Sets are always rooted at their
+// smallest label, which lets flatten() number the components in a single
+// forward pass once labeling is done.
+class DisjointSet {
+  private:
+    std::vector<int> parent;
+
+  public:
+    // Drops every set but keeps the storage for the next frame.
+    auto reset() { parent.clear(); }
+
+    // Elements are created on demand, so only labels that are actually
+    // handed out get initialized.
+    auto add() {
+        auto x = static_cast<int>(parent.size());
+        parent.push_back(x);
+        return x;
+    }
+
+    auto find(int x) {
+        while (parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+
+    auto merge(int x, int y) {
+        auto root_x = find(x);
+        auto root_y = find(y);
+        if (root_x < root_y)
+            parent[root_y] = root_x;
+        else if (root_y < root_x)
+            parent[root_x] = root_y;
+    }
+
+    // Replaces every entry with a compact component ID in 1..N, where N is
+    // the returned count. Element 0 is reserved for background and maps to
+    // 0. Afterwards only compact() may be used until the next reset().
+    auto flatten() {
+        auto count = 0;
+        for (size_t i = 1; i < parent.size(); i++) {
+            // parent[i] <= i, so parent[parent[i]] is already compact.
+            if (parent[i] == static_cast<int>(i))
+                parent[i] = ++count;
+            else
+                parent[i] = parent[parent[i]];
+        }
+        return count;
+    }
+
+    auto compact(int x) const { return parent[x]; }
+
+    // Appends the sets of `other` except its background element. Label l of
+    // `other` becomes l + offset here; the offset is returned.
+    auto append(const DisjointSet& other) {
+        auto offset = static_cast<int>(parent.size()) - 1;
+        for (size_t i = 1; i < other.parent.size(); i++)
+            parent.push_back(other.parent[i] + offset);
+        return offset;
+    }
+
+    auto labelCount() const { return static_cast<int>(parent.size()) - 1; }
+
+    auto capacityBytes() const { return parent.capacity() * sizeof(int); }
+};
+
+// Component sizes arranged for order statistics without sorting. Sizes below
+// SMALL_SIZE_LIMIT are counted in a histogram. Larger ones are kept in a
+// sorted list; a plane can only hold total_area / SMALL_SIZE_LIMIT of those,
+// so building is linear in the number of components.
+class SizeDistribution {
+  private:
+    static constexpr auto SMALL_SIZE_LIMIT = 4096;
+
+    // cumulative[s]: number of components with size <= s.
+    std::vector<int> cumulative;
+    std::vector<int> large;
+    int small_count = 0;
+    int64_t total = 0;
+
+  public:
+    auto build(std::span<const int> sizes) {
+        cumulative.assign(SMALL_SIZE_LIMIT, 0);
+        large.clear();
+        total = 0;
+
+        for (auto size : sizes) {
+            total += size;
+            if (size < SMALL_SIZE_LIMIT)
+                cumulative[size]++;
+            else
+                large.push_back(size);
+        }
+
+        for (auto s = 1; s < SMALL_SIZE_LIMIT; s++)
+            cumulative[s] += cumulative[s - 1];
+        small_count = cumulative[SMALL_SIZE_LIMIT - 1];
+
+        std::sort(large.begin(), large.end());
+    }
+
+    auto count() const {
+        return small_count + static_cast<int>(large.size());
+    }
+
+    auto totalArea() const { return total; }
+
+    // The k-th smallest size, 0 <= k < count().
+    auto nth(int k) const {
+        if (k >= small_count)
+            return large[k - small_count];
+        return static_cast<int>(
+            std::upper_bound(cumulative.begin(), cumulative.end(), k) -
+            cumulative.begin());
+    }
+
+    // Calls fn(size, components) for every distinct size, largest first,
+    // until it returns false.
+    auto forEachDescending(auto fn) const {
+        for (auto it = large.rbegin(); it != large.rend(); ++it) {
+            if (!fn(*it, 1))
+                return;
+        }
+        for (auto s = SMALL_SIZE_LIMIT - 1; s > 0; s--) {
+            auto components = cumulative[s] - cumulative[s - 1];
+            if (components > 0 && !fn(s, components))
+                return;
+        }
+    }
+
+    auto capacityBytes() const {
+        return (cumulative.capacity() + large.capacity()) * sizeof(int);
+    }
+};
+
+struct NeighborOffset {
+    int dy, dx;
+};
+
+// clang-format off
+constexpr NeighborOffset EIGHT_NEIGHBORS[] = {
+    {-1, -1}, {-1, 0}, {-1, 1}, 
+    { 0, -1},                      { 0, 1},
+    { 1, -1}, { 1, 0}, { 1, 1}
+};
+// clang-format on
+
+constexpr auto EIGHT_NEIGHBORS_COUNT = 8;
+
+// clang-format off
+constexpr NeighborOffset FOUR_NEIGHBORS[] = {
+                        {-1, 0}, 
+    {0, -1},                    {0, 1}, 
+                        {1, 0}
+};
+// clang-format on
+
+constexpr auto FOUR_NEIGHBORS_COUNT = 4;
+
+template <auto use_8_neighbors> struct NeighborhoodTraits;
+
+// causal_count: the leading entries of `neighbors` that precede a pixel in
+// raster order, which are the only ones already labeled when it is visited.
+// run_reach: how far apart (in columns) two runs on adjacent rows may end
+// and start while still touching. 0 means they must share a column.
+template <> struct NeighborhoodTraits<true> {
+    static constexpr auto neighbors = EIGHT_NEIGHBORS;
+    static constexpr auto count = EIGHT_NEIGHBORS_COUNT;
+    static constexpr auto causal_count = 4;
+    static constexpr auto run_reach = 1;
+};
+
+template <> struct NeighborhoodTraits<false> {
+    static constexpr auto neighbors = FOUR_NEIGHBORS;
+    static constexpr auto count = FOUR_NEIGHBORS_COUNT;
+    static constexpr auto causal_count = 2;
+    static constexpr auto run_reach = 0;
+};
+
+// Inclusive bounding box of a label or component.
+struct Bounds {
+    int min_x = INT_MAX, max_x = INT_MIN;
+    int min_y = INT_MAX, max_y = INT_MIN;
+
+    auto add(const Bounds& other) {
+        min_x = std::min(min_x, other.min_x);
+        max_x = std::max(max_x, other.max_x);
+        min_y = std::min(min_y, other.min_y);
+        max_y = std::max(max_y, other.max_y);
+    }
+};
+
+// One foreground component, as listed by the engines when
+// PlaneScratch::collect_records is set.
+typedef struct {
+    int area;
+    Bounds bounds;
+    // Sums of the pixel coordinates, for the centroid.
+    int64_t sum_x, sum_y;
+    bool kept;
+} ComponentRecord;
+
+// Adds the run of row y to `record`.
+static inline auto addRunToRecord(ComponentRecord& record, const Run& run,
+                                  int y) {
+    auto length = run.end - run.start;
+    record.area += length;
+    record.bounds.add({run.start, run.end - 1, y, y});
+    // start + end - 1 is even whenever length is odd.
+    record.sum_x += static_cast<int64_t>(run.start + run.end - 1) * length / 2;
+    record.sum_y += static_cast<int64_t>(y) * length;
+}
+
+static inline auto meetsShape(const Bounds& bounds, int area,
+                              const ShapeCriteria& shape) {
+    auto width = bounds.max_x - bounds.min_x + 1;
+    auto height = bounds.max_y - bounds.min_y + 1;
+    auto longer = std::max(width, height);
+    auto shorter = std::min(width, height);
+
+    return area <= shape.max_area && width >= shape.min_width &&
+           height >= shape.min_height &&
+           longer <= static_cast<double>(shape.max_aspect) * shorter &&
+           area >= static_cast<double>(shape.min_fill_ratio) * width * height;
+}
+
+// Background runs of a strip, labeled for hole filling.
+struct StripBackground {
+    std::vector<Run> runs;
+    std::vector<size_t> row_begin;
+    DisjointSet ds;
+    std::vector<int> label_sizes;
+    std::vector<uint8_t> on_border;
+
+    auto capacityBytes() const {
+        return runs.capacity() * sizeof(Run) +
+               row_begin.capacity() * sizeof(size_t) + ds.capacityBytes() +
+               label_sizes.capacity() * sizeof(int) + on_border.capacity();
+    }
+};
+
+// Run-engine buffers of one horizontal strip of a plane. Labels are local to
+// the strip until the strips are merged.
+struct StripScratch {
+    std::vector<Run> runs;
+    std::vector<Run> row_runs;
+    std::vector<size_t> row_begin;
+    DisjointSet ds;
+    std::vector<int> label_sizes;
+    std::vector<Bounds> label_bounds;
+    StripBackground background;
+
+    auto capacityBytes() const {
+        return (runs.capacity() + row_runs.capacity()) * sizeof(Run) +
+               row_begin.capacity() * sizeof(size_t) + ds.capacityBytes() +
+               label_sizes.capacity() * sizeof(int) +
+               label_bounds.capacity() * sizeof(Bounds) +
+               background.capacityBytes();
+    }
+};
+
+// Foreground runs of the last frame of a plane, kept by processPlaneRuns
+// for temporal reuse. Run labels are compact component IDs. `src` is the
+// source plane they were found in; the caller keeps it alive, and a null
+// `src` means there is nothing to reuse.
+struct TemporalPlane {
+    const void* src = nullptr;
+    ptrdiff_t src_stride = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<Run> runs;
+    std::vector<size_t> row_begin;
+    int component_count = 0;
+    // Working buffers of findChangedRows and relabelStrip.
+    std::vector<uint8_t> changed_rows;
+    std::vector<int> clean_labels;
+
+    auto invalidate() { src = nullptr; }
+
+    auto capacityBytes() const {
+        return runs.capacity() * sizeof(Run) +
+               row_begin.capacity() * sizeof(size_t) +
+               changed_rows.capacity() +
+               clean_labels.capacity() * sizeof(int);
+    }
+};
+
+// Frames with more than 1 / TEMPORAL_ROW_FRACTION of their rows changed are
+// labeled in full; relabeling only pays off for local changes.
+constexpr auto TEMPORAL_ROW_FRACTION = 4;
+
+// Phases of a labeling engine that debug_timing reports separately: finding
+// and labeling the foreground, resolving labels into components and
+// deciding which are kept, the size distribution and statistics, and
+// writing the output.
+enum class PlanePhase { Scan = 0, Resolve = 1, Stats = 2, Write = 3 };
+constexpr auto PLANE_PHASE_COUNT = 4;
+
+// What one engine call measured with PlaneTimer.
+typedef struct {
+    double seconds[PLANE_PHASE_COUNT];
+    // Provisional labels, and how many unions joined two of them. Every
+    // such union removes one set, so it is labels minus components.
+    int64_t labels;
+    int64_t unions;
+} PlaneTimings;
+
+// Timer argument of the engines. mark() ends a phase that began at the
+// previous mark, or at construction, and adds its wall time. NoPlaneTimer
+// compiles to nothing, so the engines are not slowed down without
+// debug_timing.
+struct NoPlaneTimer {
+    static constexpr bool enabled = false;
+
+    explicit NoPlaneTimer(PlaneTimings&) {}
+    auto mark(PlanePhase) {}
+};
+
+struct PlaneTimer {
+    static constexpr bool enabled = true;
+
+    PlaneTimings& timings;
+    std::chrono::steady_clock::time_point last;
+
+    explicit PlaneTimer(PlaneTimings& timings)
+        : timings(timings), last(std::chrono::steady_clock::now()) {}
+
+    auto mark(PlanePhase phase) {
+        auto now = std::chrono::steady_clock::now();
+        timings.seconds[static_cast<int>(phase)] +=
+            std::chrono::duration<double>(now - last).count();
+        last = now;
+    }
+};
+
+// Working buffers of the labeling engines. They are kept across frames and
+// only grow, so steady-state processing does not allocate.
+struct PlaneScratch {
+    std::vector<int> labels;
+    std::vector<StripScratch> strips;
+    DisjointSet ds;
+    std::vector<int> component_sizes;
+    // With shape criteria: each component's bounds and the keep decision.
+    std::vector<Bounds> component_bounds;
+    std::vector<uint8_t> component_kept;
+    // With label or area output: the value written for each component, 0
+    // when it is removed.
+    std::vector<uint32_t> component_values;
+    SizeDistribution size_distribution;
+    ComponentStats stats;
+    // Filled by engines running with PlaneTimer.
+    PlaneTimings timings;
+    // Set by the caller to have the engines list every component of the
+    // plane in `records`, in raster order of its first pixel. Components
+    // are those of the source, before hole filling; `kept` tells whether
+    // they are written. Streamed planes are not listed.
+    bool collect_records = false;
+    std::vector<ComponentRecord> records;
+    std::vector<int> record_index;
+    // Hole filling: the background components, whether each one is filled,
+    // and for each foreground component whether it lies in a filled hole.
+    DisjointSet background_ds;
+    std::vector<int> background_sizes;
+    std::vector<uint8_t> hole_filled;
+    std::vector<uint8_t> in_filled_hole;
+
+    auto capacityBytes() const {
+        auto bytes = labels.capacity() * sizeof(int) + ds.capacityBytes() +
+                     size_distribution.capacityBytes() +
+                     (component_sizes.capacity() +
+                      stats.size_percentiles.capacity() +
+                      background_sizes.capacity()) *
+                         sizeof(int) +
+                     background_ds.capacityBytes() + hole_filled.capacity() +
+                     in_filled_hole.capacity() +
+                     component_bounds.capacity() * sizeof(Bounds) +
+                     component_kept.capacity() +
+                     component_values.capacity() * sizeof(uint32_t) +
+                     records.capacity() * sizeof(ComponentRecord) +
+                     record_index.capacity() * sizeof(int);
+        for (auto& strip : strips)
+            bytes += strip.capacityBytes();
+        return bytes;
+    }
+};
+
+static inline auto computeStats(const SizeDistribution& sizes,
+                                std::span<const int> percentiles,
+                                ComponentStats& stats) {
+    auto count = sizes.count();
+    stats.component_count = count;
+
+    stats.size_percentiles.resize(percentiles.size());
+
+    for (size_t i = 0; i < percentiles.size(); i++) {
+        if (count == 0) {
+            stats.size_percentiles[i] = 0;
+            continue;
+        }
+
+        auto percentile = static_cast<float>(percentiles[i]);
+        auto idx =
+            static_cast<int>((percentile / 100.0f) * (count - 1) + 0.5f);
+        idx = std::min(std::max(0, idx), count - 1);
+        stats.size_percentiles[i] = sizes.nth(idx);
+    }
+}
+
+// Whether every sample of the plane is bitwise 0 or bitwise `value`; with
+// value 0, whether the plane is blank. Bits are compared so that -0.0 does
+// not pass for the +0.0 the engines write. Stops after the first row that
+// has any other sample.
+template <typename T>
+static inline auto isBinaryPlane(const T* VS_RESTRICT srcp, auto width,
+                                 auto height, auto src_stride,
+                                 T value) noexcept {
+    using Bits = std::conditional_t<
+        sizeof(T) == 1, uint8_t,
+        std::conditional_t<sizeof(T) == 2, uint16_t, uint32_t>>;
+    Bits value_bits;
+    std::memcpy(&value_bits, &value, sizeof(T));
+
+    for (auto y = 0; y < height; y++) {
+        auto row = reinterpret_cast<const uint8_t*>(srcp) + y * src_stride;
+        // Accumulated without branching so the loop vectorizes.
+        auto other = false;
+        for (auto x = 0; x < width; x++) {
+            Bits bits;
+            std::memcpy(&bits, row + x * sizeof(T), sizeof(T));
+            other |= bits != 0 && bits != value_bits;
+        }
+        if (other)
+            return false;
+    }
+    return true;
+}
+
+// 64-bit hash of `height` rows of `row_size` bytes, chained onto `seed`.
+// Row padding is skipped. Built like xxHash64: four independent
+// multiply-rotate lanes keep the loop at about memory bandwidth.
+static inline uint64_t hashPlane(const void* srcp, size_t row_size,
+                                 int height, ptrdiff_t stride,
+                                 uint64_t seed) noexcept {
+    constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+    constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+    constexpr uint64_t PRIME3 = 0x165667B19E3779F9ull;
+    constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t input) {
+        return rotl(acc + input * PRIME2, 31) * PRIME1;
+    };
+    auto load = [](const uint8_t* p, size_t bytes) {
+        uint64_t value = 0;
+        std::memcpy(&value, p, bytes);
+        return value;
+    };
+
+    uint64_t lanes[4] = {seed + PRIME1 + PRIME2, seed + PRIME2, seed,
+                         seed - PRIME1};
+    for (auto y = 0; y < height; y++) {
+        auto row = static_cast<const uint8_t*>(srcp) + y * stride;
+        size_t x = 0;
+        for (; x + 32 <= row_size; x += 32) {
+            for (auto lane = 0; lane < 4; lane++)
+                lanes[lane] = round(lanes[lane], load(row + x + lane * 8, 8));
+        }
+        // The tail is shorter than 32 bytes, so it fits the four lanes.
+        for (auto lane = 0; x < row_size; x += 8, lane++) {
+            auto bytes = std::min<size_t>(8, row_size - x);
+            lanes[lane] = round(lanes[lane], load(row + x, bytes));
+        }
+    }
+
+    auto hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+                rotl(lanes[3], 18);
+    for (auto lane : lanes)
+        hash = (hash ^ round(0, lane)) * PRIME1 + PRIME4;
+    hash += row_size * height;
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Smallest component size that is still kept when retaining the largest
+// components covering `percentage` of the total foreground area.
+static inline auto computeSizeThreshold(const SizeDistribution& sizes,
+                                        auto percentage) {
+    auto size_threshold = 0;
+
+    auto area_to_keep = static_cast<int64_t>(
+        static_cast<float>(sizes.totalArea()) * percentage / 100.0f + 0.5f);
+    auto current_area = int64_t{0};
+
+    // Components of equal size are added together; the threshold is the
+    // same no matter how many of them were needed.
+    sizes.forEachDescending([&](auto size, auto components) {
+        current_area += static_cast<int64_t>(size) * components;
+        size_threshold = size;
+        return current_area < area_to_keep;
+    });
+
+    return size_threshold;
+}
+
+// With write_stats false the returned stats are left untouched, and
+// AreaFilter then skips the size distribution entirely. `shape` is only
+// applied with use_shape. With write_values the plane of type D receives
+// the `output` value of each kept component instead of fg_value. The
+// destination comes from acquire_dst, see PlaneDestination. Timer is
+// PlaneTimer to record the phases in scratch.timings.
+template <bool use_8_neighbors, bool use_percentage, bool write_stats,
+          typename T, bool use_shape = false, bool write_values = false,
+          typename D = T, typename Timer = NoPlaneTimer>
+static inline auto&
+processPlane(const T* VS_RESTRICT srcp, auto acquire_dst, auto width,
+             auto height, auto src_stride, auto min_area,
+             const ShapeCriteria& shape, auto fg_value, PlaneOutput output,
+             auto percentage, auto percentiles, auto is_foreground,
+             PlaneScratch& scratch) noexcept {
+    auto src_stride_elements = src_stride / sizeof(T);
+    Timer timer(scratch.timings);
+
+    // Every entry is written in the scan below, so the map is not cleared.
+    auto& labels = scratch.labels;
+    labels.resize(static_cast<size_t>(width) * height);
+
+    auto& ds = scratch.ds;
+    ds.reset();
+    ds.add(); // label 0 marks background
+
+    // Neighbors below and to the right are never labeled yet, so only the
+    // causal half of the neighborhood is probed.
+    constexpr auto neighbors = NeighborhoodTraits<use_8_neighbors>::neighbors;
+    constexpr auto num_neighbors =
+        NeighborhoodTraits<use_8_neighbors>::causal_count;
+
+    for (auto y = 0; y < height; y++) {
+        for (auto x = 0; x < width; x++) {
+            if (!is_foreground(srcp[y * src_stride_elements + x])) {
+                labels[y * width + x] = 0;
+                continue;
+            }
+
+            auto min_label = 0;
+            int valid_neighbors[num_neighbors];
+            auto valid_count = 0;
+
+            for (auto i = 0; i < num_neighbors; i++) {
+                auto dy = neighbors[i].dy;
+                auto dx = neighbors[i].dx;
+                auto ny = y + dy;
+                auto nx = x + dx;
+
+                if (ny >= 0 && nx >= 0 && ny < height && nx < width &&
+                    is_foreground(srcp[ny * src_stride_elements + nx])) {
+                    auto neighbor_label = labels[ny * width + nx];
+                    if (neighbor_label > 0) {
+                        valid_neighbors[valid_count++] = neighbor_label;
+                        if (min_label == 0 || neighbor_label < min_label)
+                            min_label = neighbor_label;
+                    }
+                }
+            }
+
+            if (min_label == 0) {
+                labels[y * width + x] = ds.add();
+            } else {
+                labels[y * width + x] = min_label;
+
+                for (auto i = 0; i < valid_count; i++) {
+                    if (valid_neighbors[i] != min_label)
+                        ds.merge(min_label, valid_neighbors[i]);
+                }
+            }
+        }
+    }
+
+    timer.mark(PlanePhase::Scan);
+    auto component_count = ds.flatten();
+    if constexpr (Timer::enabled) {
+        scratch.timings.labels += ds.labelCount();
+        scratch.timings.unions += ds.labelCount() - component_count;
+    }
+
+    auto& component_sizes = scratch.component_sizes;
+    component_sizes.assign(component_count + 1, 0);
+    for (auto i = 0; i < width * height; i++) {
+        if (labels[i] > 0) {
+            labels[i] = ds.compact(labels[i]);
+            component_sizes[labels[i]]++;
+        }
+    }
+
+    auto& component_bounds = scratch.component_bounds;
+    if constexpr (use_shape) {
+        component_bounds.assign(component_count + 1, Bounds());
+        for (auto y = 0; y < height; y++) {
+            for (auto x = 0; x < width; x++) {
+                if (auto label = labels[y * width + x])
+                    component_bounds[label].add({x, x, y, y});
+            }
+        }
+    }
+
+    timer.mark(PlanePhase::Resolve);
+    auto& sizes = scratch.size_distribution;
+    if constexpr (write_stats || use_percentage) {
+        sizes.build(std::span(component_sizes).subspan(1));
+    }
+
+    auto& stats = scratch.stats;
+    if constexpr (write_stats) {
+        computeStats(sizes, percentiles, stats);
+    }
+
+    auto size_threshold = 0;
+
+    if constexpr (use_percentage) {
+        size_threshold = computeSizeThreshold(sizes, percentage);
+    }
+    timer.mark(PlanePhase::Stats);
+
+    auto keep_component = [&](auto label) {
+        auto component_size = component_sizes[label];
+        auto keep = false;
+
+        if constexpr (use_percentage) {
+            keep = (component_size >= size_threshold);
+        } else {
+            keep = (component_size >= min_area);
+        }
+
+        if constexpr (use_shape) {
+            keep = keep &&
+                   meetsShape(component_bounds[label], component_size, shape);
+        }
+
+        return keep;
+    };
+
+    auto all_kept = true;
+    for (auto label = 1; label <= component_count && all_kept; label++)
+        all_kept = keep_component(label);
+
+    // Compact labels are in raster order already, see below.
+    if (scratch.collect_records) {
+        auto& records = scratch.records;
+        records.assign(component_count, ComponentRecord());
+        for (auto y = 0; y < height; y++) {
+            for (auto x = 0; x < width; x++) {
+                if (auto label = labels[y * width + x])
+                    addRunToRecord(records[label - 1], {x, x + 1, label}, y);
+            }
+        }
+        for (auto label = 1; label <= component_count; label++)
+            records[label - 1].kept = keep_component(label);
+    }
+
+    auto destination = acquire_dst(all_kept);
+    D* VS_RESTRICT dstp = destination.data;
+    timer.mark(PlanePhase::Resolve);
+    if (!dstp)
+        return stats;
+
+    auto dst_stride_elements = destination.stride / sizeof(D);
+    for (auto y = 0; y < height; y++)
+        destination.clear(dstp + y * dst_stride_elements, y, 0, width);
+
+    if constexpr (write_values) {
+        // Compact labels are already in raster order of the components'
+        // first pixels, so kept components are numbered in label order.
+        constexpr uint32_t max_value = std::numeric_limits<D>::max();
+        auto& component_values = scratch.component_values;
+        component_values.assign(component_count + 1, 0);
+        auto next_id = uint32_t{0};
+        for (auto label = 1; label <= component_count; label++) {
+            if (!keep_component(label))
+                continue;
+
+            if (output == PlaneOutput::Label) {
+                next_id = std::min(next_id + 1, max_value);
+                component_values[label] = next_id;
+            } else {
+                component_values[label] = std::min(
+                    static_cast<uint32_t>(component_sizes[label]), max_value);
+            }
+        }
+
+        for (auto y = 0; y < height; y++) {
+            for (auto x = 0; x < width; x++) {
+                if (auto label = labels[y * width + x]) {
+                    dstp[y * dst_stride_elements + x] =
+                        static_cast<D>(component_values[label]);
+                }
+            }
+        }
+    } else {
+        for (auto y = 0; y < height; y++) {
+            auto apply_row = destination.apply
+                                 ? destination.row(destination.apply,
+                                                   destination.apply_stride, y)
+                                 : nullptr;
+            for (auto x = 0; x < width; x++) {
+                auto label = labels[y * width + x];
+                if (label > 0 && keep_component(label)) {
+                    dstp[y * dst_stride_elements + x] =
+                        apply_row ? apply_row[x] : fg_value;
+                }
+            }
+        }
+    }
+
+    timer.mark(PlanePhase::Write);
+    return stats;
+}
+
+// Extracts the runs of `rows` rows starting at `srcp` into `strip.runs`,
+// with the runs of row y at [row_begin[y], row_begin[y + 1]).
+template <typename T>
+static inline auto scanStrip(const T* VS_RESTRICT srcp, auto width, auto rows,
+                             auto src_stride_elements, auto fg_key,
+                             const PlaneKernels& kernels,
+                             StripScratch& strip) noexcept {
+    auto& runs = strip.runs;
+    auto& row_begin = strip.row_begin;
+    runs.clear();
+    strip.row_runs.resize((width + 1) / 2);
+    row_begin.resize(rows + 1);
+
+    for (auto y = 0; y < rows; y++) {
+        row_begin[y] = runs.size();
+
+        auto count = kernels.scan_runs(srcp + y * src_stride_elements, width,
+                                       fg_key, strip.row_runs.data());
+        runs.insert(runs.end(), strip.row_runs.begin(),
+                    strip.row_runs.begin() + count);
+    }
+    row_begin[rows] = runs.size();
+}
+
+// Gives the runs of one row provisional labels from the touching runs of
+// the row above within `reach`. Runs that touch none get a new label from
+// `add()`, and `join(a, b)` is called for every further label a run
+// touches. The labels only depend on the runs, so labeling a row again
+// gives it the same labels.
+template <int reach>
+static inline auto labelRow(std::span<Run> row, std::span<const Run> above,
+                            auto add, auto join) noexcept {
+    auto prev = size_t{0};
+
+    for (auto& run : row) {
+        run.label = 0;
+
+        // Runs above entirely to the left can touch neither this run nor
+        // any later one.
+        while (prev < above.size() && above[prev].end + reach <= run.start)
+            prev++;
+
+        for (auto j = prev;
+             j < above.size() && above[j].start < run.end + reach; j++) {
+            if (run.label == 0)
+                run.label = above[j].label;
+            else if (above[j].label != run.label)
+                join(run.label, above[j].label);
+        }
+
+        if (run.label == 0)
+            run.label = add();
+    }
+}
+
+// Gives every run a provisional label in `ds`, joining runs of consecutive
+// rows that touch within `reach`. The runs of row y are at
+// [row_begin[y], row_begin[y + 1]). label_sizes[l] receives the area of
+// label l, so component sizes can later be gathered per label instead of
+// per run.
+template <int reach>
+static inline auto labelRuns(std::vector<Run>& runs,
+                             const std::vector<size_t>& row_begin, auto rows,
+                             DisjointSet& ds,
+                             std::vector<int>& label_sizes) noexcept {
+    ds.reset();
+    ds.add(); // label 0 marks unlabeled runs
+    label_sizes.assign(1, 0);
+
+    auto add = [&]() {
+        label_sizes.push_back(0);
+        return ds.add();
+    };
+    auto join = [&](auto a, auto b) { ds.merge(a, b); };
+
+    for (auto y = 0; y < rows; y++) {
+        auto row = std::span(runs).subspan(row_begin[y],
+                                           row_begin[y + 1] - row_begin[y]);
+        auto above = y > 0 ? std::span<const Run>(runs).subspan(
+                                 row_begin[y - 1], row_begin[y] -
+                                                       row_begin[y - 1])
+                           : std::span<const Run>();
+        labelRow<reach>(row, above, add, join);
+
+        for (auto& run : row)
+            label_sizes[run.label] += run.end - run.start;
+    }
+}
+
+// Largest connect_radius. Strips are longer, so runs within the radius of
+// each other are always in the same or in adjacent strips.
+constexpr auto MAX_CONNECT_RADIUS = 32;
+
+// Like labelRuns, but runs are joined when any of their pixels are at most
+// `radius` apart: in Chebyshev distance with 8 neighbors, so that radius 1
+// is plain 8-connectivity, and in Manhattan distance with 4 neighbors.
+// A run is compared with the previous run of its own row and with the runs
+// of the `radius` rows above, through a sliding window per row, so the cost
+// grows with the radius and not with its square.
+template <bool use_8_neighbors>
+static inline auto labelRunsWithin(std::vector<Run>& runs,
+                                   const std::vector<size_t>& row_begin,
+                                   auto rows, int radius, DisjointSet& ds,
+                                   std::vector<int>& label_sizes) noexcept {
+    ds.reset();
+    ds.add(); // label 0 marks unlabeled runs
+    label_sizes.assign(1, 0);
+
+    // window[k - 1]: first run of row y - k that may still touch.
+    size_t window[MAX_CONNECT_RADIUS];
+
+    for (auto y = 0; y < rows; y++) {
+        auto above = std::min(radius, y);
+        for (auto k = 1; k <= above; k++)
+            window[k - 1] = row_begin[y - k];
+
+        for (auto i = row_begin[y]; i < row_begin[y + 1]; i++) {
+            auto& run = runs[i];
+            auto join = [&](const Run& other) {
+                if (run.label == 0)
+                    run.label = other.label;
+                else if (other.label != run.label)
+                    ds.merge(run.label, other.label);
+            };
+
+            if (i > row_begin[y] && runs[i - 1].end + radius > run.start)
+                join(runs[i - 1]);
+
+            for (auto k = 1; k <= above; k++) {
+                auto reach = use_8_neighbors ? radius : radius - k;
+                auto& j = window[k - 1];
+                auto end = row_begin[y - k + 1];
+
+                while (j < end && runs[j].end + reach <= run.start)
+                    j++;
+                for (auto m = j; m < end && runs[m].start < run.end + reach;
+                     m++)
+                    join(runs[m]);
+            }
+
+            if (run.label == 0) {
+                run.label = ds.add();
+                label_sizes.push_back(0);
+            }
+            label_sizes[run.label] += run.end - run.start;
+        }
+    }
+}
+
+// Scans and labels `rows` rows one at a time, keeping only the runs of the
+// current and the previous row, and calls visit(y, runs) for each row. See
+// labelRow for `add` and `join`.
+template <bool use_8_neighbors, typename T>
+static inline auto streamRows(const T* VS_RESTRICT srcp, auto width, auto rows,
+                              auto src_stride_elements, auto fg_key,
+                              const PlaneKernels& kernels, StripScratch& strip,
+                              auto add, auto join, auto visit) noexcept {
+    constexpr auto reach = NeighborhoodTraits<use_8_neighbors>::run_reach;
+
+    auto& row = strip.row_runs;
+    auto& above = strip.runs;
+    row.resize((width + 1) / 2);
+    above.resize((width + 1) / 2);
+    auto above_count = 0;
+
+    for (auto y = 0; y < rows; y++) {
+        auto count = kernels.scan_runs(srcp + y * src_stride_elements, width,
+                                       fg_key, row.data());
+        auto runs = std::span(row).first(count);
+        labelRow<reach>(runs, std::span<const Run>(above).first(above_count),
+                        add, join);
+        visit(y, std::span<const Run>(runs));
+
+        std::swap(row, above);
+        above_count = count;
+    }
+}
+
+// Labels the runs of `rows` rows starting at `srcp` into `strip.ds` and
+// `strip.label_sizes`. A connect_radius above 1 selects labelRunsWithin.
+template <bool use_8_neighbors, typename T>
+static inline auto labelStrip(const T* VS_RESTRICT srcp, auto width, auto rows,
+                              auto src_stride_elements, auto fg_key,
+                              int connect_radius, const PlaneKernels& kernels,
+                              StripScratch& strip) noexcept {
+    constexpr auto reach = NeighborhoodTraits<use_8_neighbors>::run_reach;
+
+    scanStrip(srcp, width, rows, src_stride_elements, fg_key, kernels, strip);
+    if (connect_radius > 1) {
+        labelRunsWithin<use_8_neighbors>(strip.runs, strip.row_begin, rows,
+                                         connect_radius, strip.ds,
+                                         strip.label_sizes);
+    } else {
+        labelRuns<reach>(strip.runs, strip.row_begin, rows, strip.ds,
+                         strip.label_sizes);
+    }
+}
+
+// Variant of labelStrip for planes too large to hold all their runs. Only
+// the runs of the current and the previous row are kept, in
+// `strip.row_runs` and `strip.runs`, so memory is O(width + labels)
+// whatever the height. Label bounds are gathered on the way with
+// use_shape, as measureStrip cannot run afterwards. The runs are labeled
+// again by streamRows when writing.
+template <bool use_8_neighbors, bool use_shape, typename T>
+static inline auto labelStripStreaming(const T* VS_RESTRICT srcp, auto width,
+                                       auto rows, auto src_stride_elements,
+                                       auto fg_key,
+                                       const PlaneKernels& kernels,
+                                       StripScratch& strip) noexcept {
+    auto& ds = strip.ds;
+    auto& label_sizes = strip.label_sizes;
+    auto& label_bounds = strip.label_bounds;
+    ds.reset();
+    ds.add(); // label 0 marks unlabeled runs
+    label_sizes.assign(1, 0);
+    if constexpr (use_shape)
+        label_bounds.assign(1, Bounds());
+
+    auto add = [&]() {
+        label_sizes.push_back(0);
+        if constexpr (use_shape)
+            label_bounds.emplace_back();
+        return ds.add();
+    };
+    auto join = [&](auto a, auto b) { ds.merge(a, b); };
+
+    streamRows<use_8_neighbors>(
+        srcp, width, rows, src_stride_elements, fg_key, kernels, strip, add,
+        join, [&](auto y, std::span<const Run> row) {
+            for (auto& run : row) {
+                label_sizes[run.label] += run.end - run.start;
+                if constexpr (use_shape)
+                    label_bounds[run.label].add({run.start, run.end - 1, y, y});
+            }
+        });
+}
+
+// Labels the background of a strip, i.e. the gaps between its foreground
+// runs, with `reach`. A label is marked as on the border when one of its
+// runs lies on the left or right edge, or on the top or bottom row of the
+// plane; `top` and `bottom` tell whether the strip has those rows.
+template <int reach>
+static inline auto labelBackground(auto width, auto rows, auto top,
+                                   auto bottom, StripScratch& strip) noexcept {
+    auto& background = strip.background;
+    auto& runs = background.runs;
+    auto& row_begin = background.row_begin;
+    runs.clear();
+    row_begin.resize(rows + 1);
+
+    for (auto y = 0; y < rows; y++) {
+        row_begin[y] = runs.size();
+
+        auto x = 0;
+        for (auto i = strip.row_begin[y]; i < strip.row_begin[y + 1]; i++) {
+            if (strip.runs[i].start > x)
+                runs.push_back({x, strip.runs[i].start, 0});
+            x = strip.runs[i].end;
+        }
+        if (x < width)
+            runs.push_back({x, width, 0});
+    }
+    row_begin[rows] = runs.size();
+
+    labelRuns<reach>(runs, row_begin, rows, background.ds,
+                     background.label_sizes);
+
+    auto& on_border = background.on_border;
+    on_border.assign(background.label_sizes.size(), 0);
+    for (auto y = 0; y < rows; y++) {
+        auto edge_row = (y == 0 && top) || (y == rows - 1 && bottom);
+        for (auto i = row_begin[y]; i < row_begin[y + 1]; i++) {
+            if (edge_row || runs[i].start == 0 || runs[i].end == width)
+                on_border[runs[i].label] = 1;
+        }
+    }
+}
+
+// Bounds of every provisional label of a strip that starts at plane row
+// `first_row`.
+static inline auto measureStrip(auto rows, auto first_row,
+                                StripScratch& strip) noexcept {
+    auto& label_bounds = strip.label_bounds;
+    label_bounds.assign(strip.label_sizes.size(), Bounds());
+
+    for (auto y = 0; y < rows; y++) {
+        for (auto i = strip.row_begin[y]; i < strip.row_begin[y + 1]; i++) {
+            auto& run = strip.runs[i];
+            label_bounds[run.label].add(
+                {run.start, run.end - 1, first_row + y, first_row + y});
+        }
+    }
+}
+
+// Merges the runs of the last row of one strip with the touching runs of
+// the first row of the next. Labels of each strip are shifted by its offset.
+static inline auto joinStrips(std::span<const Run> upper, int upper_offset,
+                              std::span<const Run> lower, int lower_offset,
+                              int reach, DisjointSet& ds) noexcept {
+    auto prev = size_t{0};
+
+    for (auto& run : lower) {
+        while (prev < upper.size() && upper[prev].end + reach <= run.start)
+            prev++;
+
+        for (auto j = prev;
+             j < upper.size() && upper[j].start < run.end + reach; j++) {
+            ds.merge(run.label + lower_offset, upper[j].label + upper_offset);
+        }
+    }
+}
+
+// joinStrips for strips labeled by labelRunsWithin: joins every pair of
+// rows across the boundary that are at most `radius` rows apart.
+template <bool use_8_neighbors>
+static inline auto joinStripsWithin(const StripScratch& upper, int upper_rows,
+                                    int upper_offset, const StripScratch& lower,
+                                    int lower_rows, int lower_offset,
+                                    int radius, DisjointSet& ds) noexcept {
+    auto row = [](const StripScratch& strip, auto y) {
+        return std::span(strip.runs).subspan(
+            strip.row_begin[y], strip.row_begin[y + 1] - strip.row_begin[y]);
+    };
+
+    for (auto y = 0; y < std::min(radius, lower_rows); y++) {
+        // k: distance in rows to row upper_rows - (k - y) of the upper strip.
+        for (auto k = y + 1; k <= radius && k - y <= upper_rows; k++) {
+            joinStrips(row(upper, upper_rows - (k - y)), upper_offset,
+                       row(lower, y), lower_offset,
+                       use_8_neighbors ? radius : radius - k, ds);
+        }
+    }
+}
+
+// 8-connected variant of labelStrip that labels two rows at a time, after
+// the 2x2 blocks of BBDT. With 8 neighbors, all foreground pixels of a
+// column pair (y, x), (y + 1, x) touch those of columns x - 1 and x + 1, so
+// the components within a row pair are the runs of the two rows ORed
+// together. These blocks are found by merging the two run lists without any
+// union-find work; only the top row of each pair is connected to the
+// previous pair through the disjoint set, which halves the finds and gives
+// every block a single provisional label.
+template <typename T>
+static inline auto labelStripBlocks(const T* VS_RESTRICT srcp, auto width,
+                                    auto rows, auto src_stride_elements,
+                                    auto fg_key, const PlaneKernels& kernels,
+                                    StripScratch& strip) noexcept {
+    constexpr auto reach = NeighborhoodTraits<true>::run_reach;
+
+    scanStrip(srcp, width, rows, src_stride_elements, fg_key, kernels, strip);
+
+    auto& runs = strip.runs;
+    auto& row_begin = strip.row_begin;
+    auto& ds = strip.ds;
+    auto& label_sizes = strip.label_sizes;
+    ds.reset();
+    ds.add(); // label 0 marks unlabeled runs
+    label_sizes.assign(1, 0);
+
+    for (auto y = 0; y < rows; y += 2) {
+        auto i = row_begin[y];
+        auto top_end = row_begin[y + 1];
+        auto j = top_end;
+        auto bottom_end = row_begin[std::min(y + 2, rows)];
+        // Bottom row of the previous pair.
+        auto prev = y > 0 ? row_begin[y - 1] : i;
+        auto prev_end = i;
+
+        // Runs of either row are consumed in order of their start. A block
+        // is closed once the next run starts beyond its reach; its members
+        // are then top[top_first, i) and bottom[bottom_first, j).
+        auto top_first = i;
+        auto bottom_first = j;
+        auto label = 0;
+        auto area = 0;
+        auto end = INT_MIN / 2;
+
+        for (;;) {
+            auto top_start = i < top_end ? runs[i].start : INT_MAX;
+            auto bottom_start = j < bottom_end ? runs[j].start : INT_MAX;
+            auto next = std::min(top_start, bottom_start);
+
+            if (next >= end + reach && (i > top_first || j > bottom_first)) {
+                if (label == 0) {
+                    label = ds.add();
+                    label_sizes.push_back(0);
+                }
+                label_sizes[label] += area;
+                for (auto k = top_first; k < i; k++)
+                    runs[k].label = label;
+                for (auto k = bottom_first; k < j; k++)
+                    runs[k].label = label;
+
+                top_first = i;
+                bottom_first = j;
+                label = 0;
+                area = 0;
+            }
+
+            if (next == INT_MAX)
+                break;
+
+            if (top_start <= bottom_start) {
+                // Only top runs can touch the previous pair.
+                auto& run = runs[i++];
+
+                while (prev < prev_end && runs[prev].end + reach <= run.start)
+                    prev++;
+
+                for (auto k = prev;
+                     k < prev_end && runs[k].start < run.end + reach; k++) {
+                    if (label == 0)
+                        label = runs[k].label;
+                    else if (runs[k].label != label)
+                        ds.merge(label, runs[k].label);
+                }
+
+                area += run.end - run.start;
+                end = std::max(end, run.end);
+            } else {
+                auto& run = runs[j++];
+                area += run.end - run.start;
+                end = std::max(end, run.end);
+            }
+        }
+    }
+}
+
+// Marks in temporal.changed_rows the rows of `srcp` that differ from
+// temporal.src and returns how many do, or -1 as soon as there are more
+// than `limit`.
+template <typename T>
+static inline auto findChangedRows(const T* VS_RESTRICT srcp, auto width,
+                                   auto height, auto src_stride, int limit,
+                                   TemporalPlane& temporal) noexcept {
+    auto& changed_rows = temporal.changed_rows;
+    changed_rows.resize(height);
+    auto row_size = static_cast<size_t>(width) * sizeof(T);
+    auto count = 0;
+
+    for (auto y = 0; y < height; y++) {
+        auto row = reinterpret_cast<const uint8_t*>(srcp) + y * src_stride;
+        auto old_row = static_cast<const uint8_t*>(temporal.src) +
+                       y * temporal.src_stride;
+        changed_rows[y] = std::memcmp(row, old_row, row_size) != 0;
+        count += changed_rows[y];
+        if (count > limit)
+            return -1;
+    }
+    return count;
+}
+
+// Fills `strip` as labelStrip would for the whole plane, reusing the
+// labeling in `temporal` of a source that differs only in
+// temporal.changed_rows. Runs of the other rows are copied instead of
+// scanned. A component without runs in or next to a changed row touches
+// neither a changed run nor a component that has one, so it is unchanged
+// and keeps a single label; only the runs of the other components are
+// labeled again.
+template <int reach, typename T>
+static inline auto relabelStrip(const T* VS_RESTRICT srcp, auto width,
+                                auto height, auto src_stride_elements,
+                                auto fg_key, const PlaneKernels& kernels,
+                                TemporalPlane& temporal,
+                                StripScratch& strip) noexcept {
+    auto& old_runs = temporal.runs;
+    auto& old_begin = temporal.row_begin;
+    auto& changed_rows = temporal.changed_rows;
+
+    // clean_labels[c]: label of unchanged component c, 0 when it is
+    // labeled again.
+    auto& clean_labels = temporal.clean_labels;
+    clean_labels.assign(temporal.component_count + 1, 1);
+    for (auto y = 0; y < height; y++) {
+        if (!changed_rows[y])
+            continue;
+        auto end = old_begin[std::min(y + 2, height)];
+        for (auto i = old_begin[std::max(y - 1, 0)]; i < end; i++)
+            clean_labels[old_runs[i].label] = 0;
+    }
+    auto clean_count = 0;
+    for (auto c = 1; c <= temporal.component_count; c++) {
+        if (clean_labels[c])
+            clean_labels[c] = ++clean_count;
+    }
+
+    auto& runs = strip.runs;
+    auto& row_begin = strip.row_begin;
+    auto& ds = strip.ds;
+    auto& label_sizes = strip.label_sizes;
+    runs.clear();
+    strip.row_runs.resize((width + 1) / 2);
+    row_begin.resize(height + 1);
+    ds.reset();
+    for (auto c = 0; c <= clean_count; c++)
+        ds.add();
+    label_sizes.assign(clean_count + 1, 0);
+
+    for (auto y = 0; y < height; y++) {
+        row_begin[y] = runs.size();
+
+        if (changed_rows[y]) {
+            auto count = kernels.scan_runs(srcp + y * src_stride_elements,
+                                           width, fg_key,
+                                           strip.row_runs.data());
+            runs.insert(runs.end(), strip.row_runs.begin(),
+                        strip.row_runs.begin() + count);
+            for (auto i = row_begin[y]; i < runs.size(); i++)
+                runs[i].label = 0;
+        } else {
+            runs.insert(runs.end(), old_runs.begin() + old_begin[y],
+                        old_runs.begin() + old_begin[y + 1]);
+            for (auto i = row_begin[y]; i < runs.size(); i++)
+                runs[i].label = clean_labels[runs[i].label];
+        }
+
+        // As in labelRow, for the runs that are labeled again. The runs
+        // above that touch one of them are labeled again as well.
+        auto above_begin = y > 0 ? row_begin[y - 1] : row_begin[y];
+        auto above_end = row_begin[y];
+        auto prev = above_begin;
+        for (auto i = row_begin[y]; i < runs.size(); i++) {
+            auto& run = runs[i];
+            if (run.label == 0) {
+                while (prev < above_end &&
+                       runs[prev].end + reach <= run.start)
+                    prev++;
+
+                for (auto j = prev;
+                     j < above_end && runs[j].start < run.end + reach; j++) {
+                    if (run.label == 0)
+                        run.label = runs[j].label;
+                    else if (runs[j].label != run.label)
+                        ds.merge(run.label, runs[j].label);
+                }
+
+                if (run.label == 0) {
+                    label_sizes.push_back(0);
+                    run.label = ds.add();
+                }
+            }
+            label_sizes[run.label] += run.end - run.start;
+        }
+    }
+    row_begin[height] = runs.size();
+}
+
+// Strips shorter than this are not worth a thread of their own.
+constexpr auto MIN_STRIP_ROWS = 64;
+constexpr auto MAX_THREADS = 64;
+static_assert(MAX_CONNECT_RADIUS < MIN_STRIP_ROWS);
+
+// use_blocks selects labelStripBlocks, which requires 8 neighbors. With
+// use_shape, components must also meet `shape`. With fill_holes, background
+// components that do not touch the plane border and are smaller than
+// min_hole_area are filled, together with the foreground components inside
+// them. The background is labeled with the complementary connectivity. With
+// write_values the plane of type D receives the `output` value of each kept
+// component instead of fg_value; it does not combine with fill_holes. The
+// destination comes from acquire_dst, see PlaneDestination. A
+// connect_radius above 1 joins components closer than that, see
+// labelRunsWithin; it combines with neither use_blocks nor fill_holes.
+// With `stream` the plane is labeled by labelStripStreaming and labeled
+// again while writing, so no runs are stored beyond two rows. It takes a
+// single thread and is ignored together with use_blocks, fill_holes or a
+// connect_radius. Timer is as for processPlane; with several strips, Scan
+// and Write are the wall time until the slowest strip is done.
+// With a `temporal` state, the labeling is kept there for the next frame.
+// When it already holds a plane of the same size that differs from this one
+// in few rows, this plane is relabeled from it by relabelStrip, on a single
+// strip. Output is the same either way. It is not reused with a
+// connect_radius, and invalidated when streaming.
+template <bool use_8_neighbors, bool use_percentage, bool write_stats,
+          typename T, bool use_blocks = false, bool fill_holes = false,
+          bool use_shape = false, bool write_values = false, typename D = T,
+          typename Timer = NoPlaneTimer>
+static inline auto&
+processPlaneRuns(const T* VS_RESTRICT srcp, auto acquire_dst, auto width,
+                 auto height, auto src_stride, auto min_area,
+                 auto min_hole_area, int connect_radius, bool stream,
+                 const ShapeCriteria& shape,
+                 auto fg_value, PlaneOutput output, auto fg_key,
+                 auto percentage, auto percentiles, auto threads,
+                 const PlaneKernels& kernels, PlaneScratch& scratch,
+                 TemporalPlane* temporal = nullptr) noexcept {
+    auto src_stride_elements = src_stride / sizeof(T);
+    Timer timer(scratch.timings);
+    // Set by merge() through acquire_dst.
+    auto destination = PlaneDestination<D>{nullptr, 0};
+    auto dst_stride_elements = ptrdiff_t{0};
+
+    static_assert(use_8_neighbors || !use_blocks);
+    static_assert(!(write_values && fill_holes));
+    constexpr auto reach = NeighborhoodTraits<use_8_neighbors>::run_reach;
+    constexpr auto background_reach =
+        NeighborhoodTraits<!use_8_neighbors>::run_reach;
+
+    constexpr auto can_stream = !use_blocks && !fill_holes;
+    stream = can_stream && stream && connect_radius == 1;
+    auto reuse = temporal && temporal->src && !stream &&
+                 connect_radius == 1 && temporal->width == width &&
+                 temporal->height == height &&
+                 findChangedRows(srcp, width, height, src_stride,
+                                 height / TEMPORAL_ROW_FRACTION,
+                                 *temporal) >= 0;
+    auto strip_count =
+        stream || reuse
+            ? 1
+            : std::max(1, std::min<int>(threads, height / MIN_STRIP_ROWS));
+    auto strip_rows = (height + strip_count - 1) / strip_count;
+    // Keep row pairs within one strip.
+    if constexpr (use_blocks)
+        strip_rows += strip_rows & 1;
+    strip_count = (height + strip_rows - 1) / strip_rows;
+
+    auto& strips = scratch.strips;
+    if (static_cast<int>(strips.size()) < strip_count)
+        strips.resize(strip_count);
+
+    auto strip_first_row = [&](auto s) { return s * strip_rows; };
+    auto strip_row_count = [&](auto s) {
+        return std::min(strip_rows, height - s * strip_rows);
+    };
+
+    // Strip-local labels are shifted by label_offsets[s] in scratch.ds, and
+    // background labels by background_offsets[s] in scratch.background_ds.
+    int label_offsets[MAX_THREADS];
+    int background_offsets[MAX_THREADS];
+    auto& ds = scratch.ds;
+    auto& stats = scratch.stats;
+    auto size_threshold = 0;
+
+    auto label = [&](auto s) {
+        auto strip_srcp = srcp + strip_first_row(s) * src_stride_elements;
+        if (reuse) {
+            relabelStrip<reach>(srcp, width, height, src_stride_elements,
+                                fg_key, kernels, *temporal, strips[s]);
+        } else if constexpr (use_blocks) {
+            labelStripBlocks(strip_srcp, width, strip_row_count(s),
+                             src_stride_elements, fg_key, kernels, strips[s]);
+        } else {
+            if constexpr (can_stream) {
+                if (stream) {
+                    labelStripStreaming<use_8_neighbors, use_shape>(
+                        strip_srcp, width, height, src_stride_elements,
+                        fg_key, kernels, strips[s]);
+                    return;
+                }
+            }
+            labelStrip<use_8_neighbors>(strip_srcp, width, strip_row_count(s),
+                                        src_stride_elements, fg_key,
+                                        connect_radius, kernels, strips[s]);
+        }
+
+        if constexpr (use_shape) {
+            measureStrip(strip_row_count(s), strip_first_row(s), strips[s]);
+        }
+
+        if constexpr (fill_holes) {
+            labelBackground<background_reach>(width, strip_row_count(s),
+                                              s == 0, s == strip_count - 1,
+                                              strips[s]);
+        }
+    };
+
+    auto last_row = [&](const auto& runs, const auto& row_begin, auto s) {
+        return std::span(runs).subspan(row_begin[strip_row_count(s) - 1]);
+    };
+    auto first_row = [&](const auto& runs, const auto& row_begin) {
+        return std::span(runs).first(row_begin[1]);
+    };
+
+    auto& background_ds = scratch.background_ds;
+    auto& hole_filled = scratch.hole_filled;
+    auto& in_filled_hole = scratch.in_filled_hole;
+
+    auto merge_holes = [&](auto component_count) noexcept {
+        background_ds.reset();
+        background_ds.add();
+        for (auto s = 0; s < strip_count; s++) {
+            background_offsets[s] =
+                background_ds.append(strips[s].background.ds);
+        }
+
+        for (auto s = 1; s < strip_count; s++) {
+            auto& upper = strips[s - 1].background;
+            auto& lower = strips[s].background;
+            joinStrips(last_row(upper.runs, upper.row_begin, s - 1),
+                       background_offsets[s - 1],
+                       first_row(lower.runs, lower.row_begin),
+                       background_offsets[s], background_reach, background_ds);
+        }
+
+        auto background_count = background_ds.flatten();
+
+        // hole_filled first collects whether a component is on the border.
+        auto& background_sizes = scratch.background_sizes;
+        background_sizes.assign(background_count + 1, 0);
+        hole_filled.assign(background_count + 1, 0);
+        for (auto s = 0; s < strip_count; s++) {
+            auto& background = strips[s].background;
+            for (size_t l = 1; l < background.label_sizes.size(); l++) {
+                auto c = background_ds.compact(l + background_offsets[s]);
+                background_sizes[c] += background.label_sizes[l];
+                hole_filled[c] |= background.on_border[l];
+            }
+        }
+        for (auto c = 1; c <= background_count; c++) {
+            hole_filled[c] =
+                !hole_filled[c] && background_sizes[c] < min_hole_area;
+        }
+
+        // The pixel above the first pixel of a foreground component, in
+        // raster order, is background and belongs to the region around the
+        // component. Nothing of the component lies above it, so it cannot be
+        // one of the component's own holes.
+        constexpr uint8_t UNSEEN = 2;
+        in_filled_hole.assign(component_count + 1, UNSEEN);
+        for (auto s = 0; s < strip_count; s++) {
+            auto& strip = strips[s];
+            for (auto y = 0; y < strip_row_count(s); y++) {
+                // Background runs of the row above and their label offset.
+                auto above = std::span<const Run>();
+                auto above_offset = 0;
+                if (y > 0) {
+                    auto& background = strip.background;
+                    above = std::span(background.runs)
+                                .subspan(background.row_begin[y - 1],
+                                         background.row_begin[y] -
+                                             background.row_begin[y - 1]);
+                    above_offset = background_offsets[s];
+                } else if (s > 0) {
+                    auto& background = strips[s - 1].background;
+                    above = last_row(background.runs, background.row_begin,
+                                     s - 1);
+                    above_offset = background_offsets[s - 1];
+                }
+
+                auto j = size_t{0};
+                for (auto i = strip.row_begin[y]; i < strip.row_begin[y + 1];
+                     i++) {
+                    auto& run = strip.runs[i];
+                    auto c = ds.compact(run.label + label_offsets[s]);
+                    if (in_filled_hole[c] != UNSEEN)
+                        continue;
+
+                    while (j < above.size() && above[j].end <= run.start)
+                        j++;
+                    in_filled_hole[c] =
+                        j < above.size() && above[j].start <= run.start &&
+                        hole_filled[background_ds.compact(above[j].label +
+                                                          above_offset)];
+                }
+            }
+        }
+    };
+
+    auto passes_size = [&](auto component) {
+        auto component_size = scratch.component_sizes[component];
+
+        if constexpr (use_percentage) {
+            return component_size >= size_threshold;
+        } else {
+            return component_size >= min_area;
+        }
+    };
+
+    // With shape criteria the decision is made once per component, in
+    // merge().
+    auto keep_component = [&](auto component) {
+        if constexpr (use_shape) {
+            return scratch.component_kept[component] != 0;
+        } else {
+            return passes_size(component);
+        }
+    };
+
+    // Label IDs are handed out in raster order of each kept component's
+    // first run, in merge() or, when streaming, while writing.
+    auto next_id = uint32_t{0};
+    auto assign_id = [&](auto component) {
+        if constexpr (write_values) {
+            constexpr uint32_t max_value = std::numeric_limits<D>::max();
+            next_id = std::min(next_id + 1, max_value);
+            scratch.component_values[component] = next_id;
+        }
+    };
+
+    // Component IDs of the engines are not in raster order, so records are
+    // numbered as their components are first met.
+    auto collect_records = [&](auto component_count) {
+        auto& records = scratch.records;
+        auto& record_index = scratch.record_index;
+        records.clear();
+        record_index.assign(component_count + 1, -1);
+
+        for (auto s = 0; s < strip_count; s++) {
+            auto& strip = strips[s];
+            for (auto y = 0; y < strip_row_count(s); y++) {
+                for (auto i = strip.row_begin[y]; i < strip.row_begin[y + 1];
+                     i++) {
+                    auto& run = strip.runs[i];
+                    auto c = ds.compact(run.label + label_offsets[s]);
+                    if (record_index[c] < 0) {
+                        record_index[c] = static_cast<int>(records.size());
+                        auto kept = keep_component(c);
+                        if constexpr (fill_holes)
+                            kept = kept || in_filled_hole[c];
+                        records.push_back(ComponentRecord());
+                        records.back().kept = kept;
+                    }
+                    addRunToRecord(records[record_index[c]], run,
+                                   strip_first_row(s) + y);
+                }
+            }
+        }
+    };
+
+    auto merge = [&]() noexcept {
+        timer.mark(PlanePhase::Scan);
+        ds.reset();
+        ds.add();
+        for (auto s = 0; s < strip_count; s++)
+            label_offsets[s] = ds.append(strips[s].ds);
+
+        // Join components that continue across strip boundaries. Only the
+        // last row of the upper strip and the first row of the lower one
+        // can touch, or the last and first connect_radius rows.
+        for (auto s = 1; s < strip_count; s++) {
+            auto& upper = strips[s - 1];
+            auto& lower = strips[s];
+            if (connect_radius > 1) {
+                joinStripsWithin<use_8_neighbors>(
+                    upper, strip_row_count(s - 1), label_offsets[s - 1], lower,
+                    strip_row_count(s), label_offsets[s], connect_radius, ds);
+            } else {
+                joinStrips(last_row(upper.runs, upper.row_begin, s - 1),
+                           label_offsets[s - 1],
+                           first_row(lower.runs, lower.row_begin),
+                           label_offsets[s], reach, ds);
+            }
+        }
+
+        auto component_count = ds.flatten();
+        if constexpr (Timer::enabled) {
+            scratch.timings.labels += ds.labelCount();
+            scratch.timings.unions += ds.labelCount() - component_count;
+        }
+
+        auto& component_sizes = scratch.component_sizes;
+        component_sizes.assign(component_count + 1, 0);
+        for (auto s = 0; s < strip_count; s++) {
+            auto& label_sizes = strips[s].label_sizes;
+            for (size_t l = 1; l < label_sizes.size(); l++) {
+                component_sizes[ds.compact(l + label_offsets[s])] +=
+                    label_sizes[l];
+            }
+        }
+
+        timer.mark(PlanePhase::Resolve);
+        auto& sizes = scratch.size_distribution;
+        if constexpr (write_stats || use_percentage) {
+            sizes.build(std::span(component_sizes).subspan(1));
+        }
+
+        if constexpr (write_stats) {
+            computeStats(sizes, percentiles, stats);
+        }
+
+        if constexpr (use_percentage) {
+            size_threshold = computeSizeThreshold(sizes, percentage);
+        }
+        timer.mark(PlanePhase::Stats);
+
+        if constexpr (use_shape) {
+            auto& component_bounds = scratch.component_bounds;
+            component_bounds.assign(component_count + 1, Bounds());
+            for (auto s = 0; s < strip_count; s++) {
+                auto& label_bounds = strips[s].label_bounds;
+                for (size_t l = 1; l < label_bounds.size(); l++) {
+                    component_bounds[ds.compact(l + label_offsets[s])].add(
+                        label_bounds[l]);
+                }
+            }
+
+            auto& component_kept = scratch.component_kept;
+            component_kept.resize(component_count + 1);
+            for (auto c = 1; c <= component_count; c++) {
+                component_kept[c] =
+                    passes_size(c) && meetsShape(component_bounds[c],
+                                                 component_sizes[c], shape);
+            }
+        }
+
+        if constexpr (fill_holes) {
+            merge_holes(component_count);
+        }
+
+        // Label IDs follow the first run of each kept component in raster
+        // order. The block engine creates labels per row pair, so the
+        // compact label order cannot be used for that directly.
+        if constexpr (write_values) {
+            constexpr uint32_t max_value = std::numeric_limits<D>::max();
+            auto& component_values = scratch.component_values;
+            component_values.assign(component_count + 1, 0);
+
+            if (output == PlaneOutput::Area) {
+                for (auto c = 1; c <= component_count; c++) {
+                    if (keep_component(c)) {
+                        component_values[c] = std::min(
+                            static_cast<uint32_t>(component_sizes[c]),
+                            max_value);
+                    }
+                }
+            } else if (!stream) {
+                for (auto s = 0; s < strip_count; s++) {
+                    for (auto& run : strips[s].runs) {
+                        auto c = ds.compact(run.label + label_offsets[s]);
+                        if (component_values[c] == 0 && keep_component(c))
+                            assign_id(c);
+                    }
+                }
+            }
+        }
+
+        auto all_kept = true;
+        for (auto c = 1; c <= component_count && all_kept; c++)
+            all_kept = keep_component(c);
+        if constexpr (fill_holes) {
+            all_kept = all_kept && std::find(hole_filled.begin() + 1,
+                                             hole_filled.end(),
+                                             1) == hole_filled.end();
+        }
+
+        if (scratch.collect_records && !stream)
+            collect_records(component_count);
+
+        destination = acquire_dst(all_kept);
+        dst_stride_elements = destination.stride / sizeof(D);
+        timer.mark(PlanePhase::Resolve);
+    };
+
+    // Writes row y of strip s, whose foreground runs are `runs`. Every
+    // sample is written exactly once: gaps are cleared and kept runs filled,
+    // instead of clearing the whole row first.
+    auto write_row = [&](auto s, auto y, std::span<const Run> runs) {
+        auto plane_y = strip_first_row(s) + y;
+        auto row = destination.data + plane_y * dst_stride_elements;
+        auto apply_row = destination.apply
+                             ? destination.row(destination.apply,
+                                               destination.apply_stride,
+                                               plane_y)
+                             : nullptr;
+        auto clear = [&](auto start, auto end) {
+            destination.clear(row, plane_y, start, end);
+        };
+        auto fill = [&](auto start, auto end) {
+            if (apply_row)
+                std::memcpy(row + start, apply_row + start,
+                            (end - start) * sizeof(D));
+            else
+                kernels.fill_span(row + start, end - start, fg_value);
+        };
+        auto x = 0;
+
+        if constexpr (fill_holes) {
+            // The gaps between foreground runs are the background runs, in
+            // the same order. The gap after the last run is on the border
+            // and never filled.
+            auto& background = strips[s].background;
+            auto j = background.row_begin[y];
+            auto write_span = [&](auto start, auto end, auto keep) {
+                if (keep)
+                    fill(start, end);
+                else
+                    clear(start, end);
+            };
+
+            for (auto& run : runs) {
+                if (run.start > x) {
+                    auto hole = background_ds.compact(
+                        background.runs[j++].label + background_offsets[s]);
+                    write_span(x, run.start, hole_filled[hole]);
+                }
+
+                auto component = ds.compact(run.label + label_offsets[s]);
+                write_span(run.start, run.end,
+                           keep_component(component) ||
+                               in_filled_hole[component]);
+                x = run.end;
+            }
+        } else if constexpr (write_values) {
+            for (auto& run : runs) {
+                auto c = ds.compact(run.label + label_offsets[s]);
+                if (stream && output == PlaneOutput::Label &&
+                    scratch.component_values[c] == 0 && keep_component(c))
+                    assign_id(c);
+
+                auto value = scratch.component_values[c];
+                if (value) {
+                    clear(x, run.start);
+                    std::fill(row + run.start, row + run.end,
+                              static_cast<D>(value));
+                    x = run.end;
+                }
+            }
+        } else {
+            for (auto& run : runs) {
+                if (keep_component(ds.compact(run.label + label_offsets[s]))) {
+                    clear(x, run.start);
+                    fill(run.start, run.end);
+                    x = run.end;
+                }
+            }
+        }
+
+        clear(x, width);
+    };
+
+    auto write = [&](auto s) {
+        auto& strip = strips[s];
+        if (!destination.data)
+            return;
+
+        // The runs are scanned and labeled again. Labels are handed out in
+        // the same order as by labelStripStreaming, so counting them is
+        // enough.
+        if constexpr (can_stream) {
+            if (stream) {
+                auto labels = 0;
+                auto add = [&]() { return ++labels; };
+                streamRows<use_8_neighbors>(
+                    srcp, width, height, src_stride_elements, fg_key, kernels,
+                    strip, add, [](auto, auto) {},
+                    [&](auto y, std::span<const Run> runs) {
+                        write_row(s, y, runs);
+                    });
+                return;
+            }
+        }
+
+        for (auto y = 0; y < strip_row_count(s); y++) {
+            write_row(s, y,
+                      std::span<const Run>(strip.runs).subspan(
+                          strip.row_begin[y],
+                          strip.row_begin[y + 1] - strip.row_begin[y]));
+        }
+    };
+
+    // Stores the runs of every strip with their component IDs for the next
+    // frame.
+    auto keep_temporal = [&]() {
+        if (!temporal)
+            return;
+        if (stream) {
+            temporal->invalidate();
+            return;
+        }
+
+        temporal->src = srcp;
+        temporal->src_stride = src_stride;
+        temporal->width = width;
+        temporal->height = height;
+        temporal->component_count =
+            static_cast<int>(scratch.component_sizes.size()) - 1;
+
+        auto& runs = temporal->runs;
+        auto& row_begin = temporal->row_begin;
+        runs.clear();
+        row_begin.resize(height + 1);
+        for (auto s = 0; s < strip_count; s++) {
+            auto& strip = strips[s];
+            for (auto y = 0; y < strip_row_count(s); y++) {
+                row_begin[strip_first_row(s) + y] = runs.size();
+                for (auto i = strip.row_begin[y]; i < strip.row_begin[y + 1];
+                     i++) {
+                    auto& run = strip.runs[i];
+                    runs.push_back({run.start, run.end,
+                                    ds.compact(run.label + label_offsets[s])});
+                }
+            }
+        }
+        row_begin[height] = runs.size();
+    };
+
+    if (strip_count == 1) {
+        label(0);
+        merge();
+        write(0);
+        keep_temporal();
+        timer.mark(PlanePhase::Write);
+        return stats;
+    }
+
+    // Strips are labeled and written in parallel; merging the strips and
+    // computing the statistics runs once in between, on whichever thread
+    // arrives last.
+    std::barrier sync(strip_count, merge);
+    auto work = [&](auto s) {
+        label(s);
+        sync.arrive_and_wait();
+        write(s);
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(strip_count - 1);
+    for (auto s = 1; s < strip_count; s++)
+        workers.emplace_back(work, s);
+    work(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    keep_temporal();
+    timer.mark(PlanePhase::Write);
+    return stats;
+}
+
+// Writes fg_value where an area map produced with PlaneOutput::Area is at
+// least min_area and 0 elsewhere. This derives further masks from a single
+// labeling: an area map made with the smallest threshold holds everything
+// a larger one keeps.
+template <typename A, typename T>
+static inline auto thresholdAreas(const A* VS_RESTRICT areap,
+                                  T* VS_RESTRICT dstp, auto width,
+                                  auto height, auto area_stride,
+                                  auto dst_stride, A min_area,
+                                  T fg_value) noexcept {
+    auto area_stride_elements = area_stride / sizeof(A);
+    auto dst_stride_elements = dst_stride / sizeof(T);
+
+    for (auto y = 0; y < height; y++) {
+        auto area_row = areap + y * area_stride_elements;
+        auto row = dstp + y * dst_stride_elements;
+        for (auto x = 0; x < width; x++)
+            row[x] = area_row[x] >= min_area ? fg_value : T{};
+    }
+}
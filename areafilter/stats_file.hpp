@@ -0,0 +1,45 @@
+#pragma once
+
+// Layout of the stats_file sidecar, shared by the filters and
+// tools/dump_stats.cpp. Integers and floats are stored in native byte
+// order, which is little-endian on every platform VapourSynth runs on.
+//
+// The file starts with a StatsFileHeader. It is followed by one block per
+// processed plane of every frame, in frame order and then plane order: a
+// StatsPlaneHeader and `component_count` StatsRecords, one per component
+// in raster order of its first pixel.
+
+#include <cstdint>
+
+constexpr char STATS_FILE_MAGIC[8] = {'A', 'F', 'S', 'T', 'A', 'T', 'S', 0};
+constexpr uint32_t STATS_FILE_VERSION = 1;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    // sizeof(StatsRecord), so that readers can skip fields added later.
+    uint32_t record_size;
+} StatsFileHeader;
+
+typedef struct {
+    int32_t frame;
+    int32_t plane;
+    int32_t width;
+    int32_t height;
+    int32_t component_count;
+} StatsPlaneHeader;
+
+// StatsRecord::flags.
+constexpr uint32_t STATS_RECORD_KEPT = 1;
+
+typedef struct {
+    int32_t area;
+    // Inclusive bounding box.
+    int32_t min_x, min_y, max_x, max_y;
+    float centroid_x, centroid_y;
+    uint32_t flags;
+} StatsRecord;
+
+static_assert(sizeof(StatsFileHeader) == 16);
+static_assert(sizeof(StatsPlaneHeader) == 20);
+static_assert(sizeof(StatsRecord) == 32);
@@ -0,0 +1,108 @@
+// Prints the component records of a stats_file written by AreaFilter or
+// RelFilter, one line per component:
+//
+//     frame plane area min_x min_y max_x max_y centroid_x centroid_y kept
+//
+// Meson builds it on request:
+//
+//     meson compile -C build dump_stats
+//     build/dump_stats [--summary] file
+//
+// --summary prints one line per frame and plane with the number of
+// components instead, and how many of them are kept.
+
+#include "stats_file.hpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+int main(int argc, char** argv) {
+    auto summary = false;
+    const char* path = nullptr;
+    auto usage = false;
+
+    for (auto i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--summary") == 0)
+            summary = true;
+        else if (!path)
+            path = argv[i];
+        else
+            usage = true;
+    }
+
+    if (!path || usage) {
+        std::fprintf(stderr, "usage: %s [--summary] file\n", argv[0]);
+        return 2;
+    }
+
+    auto file = std::fopen(path, "rb");
+    if (!file) {
+        std::fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    StatsFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+        std::memcmp(header.magic, STATS_FILE_MAGIC, sizeof(header.magic)) !=
+            0 ||
+        header.record_size < sizeof(StatsRecord)) {
+        std::fprintf(stderr, "%s is not a stats_file\n", path);
+        std::fclose(file);
+        return 1;
+    }
+    if (header.version > STATS_FILE_VERSION) {
+        std::fprintf(stderr, "%s has version %u, only %u is known\n", path,
+                     header.version, STATS_FILE_VERSION);
+        std::fclose(file);
+        return 1;
+    }
+
+    if (summary)
+        std::printf("frame plane width height components kept\n");
+    else
+        std::printf("frame plane area min_x min_y max_x max_y centroid_x "
+                    "centroid_y kept\n");
+
+    // Records are read whole and only their known prefix is used.
+    std::vector<unsigned char> buffer(header.record_size);
+    StatsPlaneHeader plane;
+    auto ok = true;
+
+    while (std::fread(&plane, sizeof(plane), 1, file) == 1) {
+        auto kept = 0;
+        for (auto i = 0; i < plane.component_count; i++) {
+            if (std::fread(buffer.data(), buffer.size(), 1, file) != 1) {
+                ok = false;
+                break;
+            }
+
+            StatsRecord record;
+            std::memcpy(&record, buffer.data(), sizeof(record));
+            auto is_kept = (record.flags & STATS_RECORD_KEPT) != 0;
+            kept += is_kept;
+            if (!summary) {
+                std::printf("%d %d %d %d %d %d %d %.3f %.3f %d\n",
+                            plane.frame, plane.plane, record.area,
+                            record.min_x, record.min_y, record.max_x,
+                            record.max_y, record.centroid_x,
+                            record.centroid_y, is_kept);
+            }
+        }
+        if (!ok)
+            break;
+
+        if (summary) {
+            std::printf("%d %d %d %d %d %d\n", plane.frame, plane.plane,
+                        plane.width, plane.height, plane.component_count,
+                        kept);
+        }
+    }
+
+    ok = ok && !std::ferror(file);
+    std::fclose(file);
+    if (!ok) {
+        std::fprintf(stderr, "%s is truncated\n", path);
+        return 1;
+    }
+    return 0;
+}